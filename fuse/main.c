@@ -5,134 +5,1289 @@
 */
 
 #define _POSIX_C_SOURCE 200809L
-#define FUSE_USE_VERSION 26
+#define _GNU_SOURCE
+#ifdef HAVE_FUSE_LOOP_CFG_CREATE
+#define FUSE_USE_VERSION 312
+#else
+#define FUSE_USE_VERSION 34
+#endif
 
-#include <fuse.h>
+#include <fuse_lowlevel.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <time.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
 
 #include "sparsebundle.h"
+#include "partition.h"
+
+#define MIN(a,b) (((a)<(b))?(a):(b))
 
 #define xstr(s) str(s)
 #define str(s) #s
 
 #define DEFAULT_MAX_OPEN_BANDS 16
+/* largest read and write the kernel is asked to send, 1 MiB */
+#define MAX_IO_SIZE 1048576
+/* default for --attr-timeout, seconds */
+#define ATTR_TIMEOUT 1.0
+/* block size reported by statfs */
+#define STATFS_BLOCK_SIZE 4096
+/* band segments one request may span, more go through a copy */
+#define MAX_SEGMENTS 8
+
+#define ROOT_INO FUSE_ROOT_ID
+#define IMAGE_INO 2
+/* --passthrough: one file per band under bands/ */
+#define BANDS_INO 3
+/* library statistics in the prometheus text format, made on open */
+#define STATS_INO 4
+#define STATS_NAME ".sparsebundle-stats"
+/* partitions found in the image, next to it as sN */
+#define MAX_PARTITIONS 128
+#define PARTITION_INO_BASE 16
+#define PARTITION_INO(i) (PARTITION_INO_BASE + (fuse_ino_t)(i))
+#define BAND_INO_BASE PARTITION_INO(MAX_PARTITIONS)
+#define BAND_INO(id) (BAND_INO_BASE + (fuse_ino_t)(id))
+/* several bundles, which have neither partitions nor bands served */
+#define BUNDLE_INO_BASE PARTITION_INO_BASE
+#define BUNDLE_INO(i) (BUNDLE_INO_BASE + (fuse_ino_t)(i))
+
+#define BUNDLE_SUFFIX ".sparsebundle"
+#define IMAGE_SUFFIX ".dmg"
+/* default for --idle-timeout, seconds */
+#define IDLE_TIMEOUT 60
 
 static struct sparse_fuse_options {
 	char *filename;
+	char *directory;
+	/* bundles and the mountpoint, in the order given */
+	char **paths;
+	int path_count;
+	int idle_timeout;
+	char *prealloc;
+	char *access;
 	int show_help;
+	int no_splice;
+	int passthrough;
+	int no_partitions;
+	int writeback_cache;
+	int keep_cache;
+	double attr_timeout;
 	struct sparse_options options;
 } sparse_fuse_options = {0};
 
-static struct sparse_state *sparse_state = NULL;
+/*
+  a bundle served as an image file. a single bundle is opened before
+  mounting and stays open. with several, each one is opened on first use
+  and closed after --idle-timeout seconds without open files or requests,
+  and all of them share one band cache. opening and closing happen
+  outside sparse_fuse_bundle_lock, with the bundle marked busy meanwhile.
+*/
+struct sparse_fuse_bundle {
+	char *path;
+	/* the image file at the mountpoint */
+	char *name;
+	/* NULL while closed */
+	sparse_handle_t state;
+	/* as of when it was last closed, for statfs */
+	struct sparse_usage usage;
+	size_t size;
+	/* open files and requests in flight */
+	int refs;
+	time_t last_used;
+	/* --directory: not found by the last scan */
+	int gone;
+	/* being opened or closed, state is NULL until it is done */
+	int busy;
+};
+
+/* bundles are added but never freed, their inodes stay valid */
+static struct sparse_fuse_bundle **sparse_fuse_bundles = NULL;
+static int sparse_fuse_bundle_count = 0;
+static int sparse_fuse_multi = 0;
+static pthread_mutex_t sparse_fuse_bundle_lock = PTHREAD_MUTEX_INITIALIZER;
+/* signalled when a bundle is no longer busy */
+static pthread_cond_t sparse_fuse_bundle_done = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t sparse_fuse_reaper_wake = PTHREAD_COND_INITIALIZER;
+static int sparse_fuse_reaper_stop = 0;
+
+/* set by init when the kernel takes backing files */
+static int sparse_fuse_passthrough = 0;
+/*
+  opens handed to a backing file, of the image or of bands/N. the band
+  files behind them must keep their length and must not be removed.
+*/
+static int sparse_fuse_backed = 0;
+
+/* read once the bundle is open, later changes to the map are not seen */
+static struct sparse_partition sparse_fuse_partitions[MAX_PARTITIONS];
+static int sparse_fuse_partition_count = 0;
+
+/* for invalidating what the kernel caches when the size changes */
+static struct fuse_session *sparse_fuse_session = NULL;
+
+/* read replies point here for holes */
+static char sparse_zeros[MAX_IO_SIZE];
 
 #define OPTION(t, p) \
 	{ t, offsetof(struct sparse_fuse_options, p), 1 }
 
+enum {
+	KEY_RO,
+};
+
 static const struct fuse_opt option_spec[] = {
 	OPTION("--name=%s", filename),
+	OPTION("--directory=%s", directory),
+	OPTION("--idle-timeout=%d", idle_timeout),
 	OPTION("--help", show_help),
+	OPTION("-h", show_help),
 	OPTION("--max-open-bands=%d", options.max_open_bands),
+	OPTION("--prealloc=%s", prealloc),
+	OPTION("--mmap", options.mmap_bands),
+	OPTION("--access=%s", access),
+	OPTION("--direct", options.direct_io),
+	OPTION("--no-splice", no_splice),
+	OPTION("--passthrough", passthrough),
+	OPTION("--no-partitions", no_partitions),
+	OPTION("--writeback-cache", writeback_cache),
+	OPTION("--keep-cache", keep_cache),
+	OPTION("--attr-timeout=%lf", attr_timeout),
+	FUSE_OPT_KEY("ro", KEY_RO),
 	FUSE_OPT_END
 };
 
 #define DEFAULT_FILENAME "sparsebundle.dmg"
 
+inline static time_t sparse_fuse_now(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec;
+}
+
+/* locking: sparse_fuse_bundle_lock required */
+static struct sparse_fuse_bundle *sparse_fuse_add_bundle(const char *path, const char *name)
+{
+	struct sparse_fuse_bundle *bundle = calloc(1, sizeof(*bundle));
+	bundle->path = strdup(path);
+	bundle->name = strdup(name);
+	sparse_fuse_bundles = realloc(sparse_fuse_bundles, (sparse_fuse_bundle_count + 1) * sizeof(*sparse_fuse_bundles));
+	sparse_fuse_bundles[sparse_fuse_bundle_count++] = bundle;
+	return bundle;
+}
+
+/* locking: sparse_fuse_bundle_lock required */
+static struct sparse_fuse_bundle *sparse_fuse_find_bundle(const char *name)
+{
+	for (int i = 0; i < sparse_fuse_bundle_count; i++) {
+		if (strcmp(sparse_fuse_bundles[i]->name, name) == 0) {
+			return sparse_fuse_bundles[i];
+		}
+	}
+	return NULL;
+}
+
+/* image file name for a bundle path, NAME.sparsebundle is served as NAME.dmg */
+static char *sparse_fuse_image_name(const char *path)
+{
+	size_t length = strlen(path);
+	while (length > 1 && path[length - 1] == '/') {
+		length--;
+	}
+	const char *base = path + length;
+	while (base > path && base[-1] != '/') {
+		base--;
+	}
+	length -= base - path;
+	size_t suffix_length = strlen(BUNDLE_SUFFIX);
+	if (length > suffix_length && strncmp(base + length - suffix_length, BUNDLE_SUFFIX, suffix_length) == 0) {
+		length -= suffix_length;
+	}
+	if (length == 0 || base[0] == '.' || length + strlen(IMAGE_SUFFIX) > NAME_MAX) {
+		return NULL;
+	}
+	char *name = malloc(length + strlen(IMAGE_SUFFIX) + 1);
+	memcpy(name, base, length);
+	strcpy(name + length, IMAGE_SUFFIX);
+	return name;
+}
+
+/*
+  --directory: adds the bundles that appeared since the last scan and marks
+  those that went away. returns 0 or a negative errno.
+  locking: sparse_fuse_bundle_lock required
+*/
+static int sparse_fuse_scan(void)
+{
+	struct dirent *entry;
+	DIR *dir = opendir(sparse_fuse_options.directory);
+	if (dir == NULL) {
+		return -errno;
+	}
+	for (int i = 0; i < sparse_fuse_bundle_count; i++) {
+		sparse_fuse_bundles[i]->gone = 1;
+	}
+	while ((entry = readdir(dir)) != NULL) {
+		size_t length = strlen(entry->d_name);
+		if (length <= strlen(BUNDLE_SUFFIX) || strcmp(entry->d_name + length - strlen(BUNDLE_SUFFIX), BUNDLE_SUFFIX)) {
+			continue;
+		}
+		char *name = sparse_fuse_image_name(entry->d_name);
+		if (name == NULL) {
+			continue;
+		}
+		struct sparse_fuse_bundle *bundle = sparse_fuse_find_bundle(name);
+		if (bundle == NULL) {
+			size_t path_length = strlen(sparse_fuse_options.directory) + length + 2;
+			char *path = malloc(path_length);
+			snprintf(path, path_length, "%s/%s", sparse_fuse_options.directory, entry->d_name);
+			bundle = sparse_fuse_add_bundle(path, name);
+			free(path);
+		}
+		bundle->gone = 0;
+		free(name);
+	}
+	closedir(dir);
+	return 0;
+}
+
+/* the bundle behind ino, NULL if there is none. locking: sparse_fuse_bundle_lock required */
+static struct sparse_fuse_bundle *sparse_fuse_bundle_of(fuse_ino_t ino)
+{
+	if (!sparse_fuse_multi) {
+		return ino == ROOT_INO || ino == BANDS_INO ? NULL : sparse_fuse_bundles[0];
+	}
+	if (ino < BUNDLE_INO_BASE || ino >= BUNDLE_INO(sparse_fuse_bundle_count) ||
+		sparse_fuse_bundles[ino - BUNDLE_INO_BASE]->gone) {
+		return NULL;
+	}
+	return sparse_fuse_bundles[ino - BUNDLE_INO_BASE];
+}
+
+inline static int sparse_fuse_is_image(fuse_ino_t ino)
+{
+	return sparse_fuse_multi ? ino >= BUNDLE_INO_BASE : ino == IMAGE_INO;
+}
+
+inline static int sparse_fuse_band_count(sparse_handle_t state)
+{
+	size_t band_size = sparse_get_band_size(state);
+	return (sparse_get_size(state) + band_size - 1) / band_size;
+}
+
+/* where a file lies in the image, -ENOENT for inodes that are not files */
+static int sparse_fuse_window(sparse_handle_t state, fuse_ino_t ino, off_t *base, off_t *length)
+{
+	off_t size = sparse_get_size(state);
+	if (sparse_fuse_is_image(ino)) {
+		*base = 0;
+		*length = size;
+	} else if (sparse_fuse_multi) {
+		return -ENOENT;
+	} else if (ino >= PARTITION_INO_BASE && ino < PARTITION_INO(sparse_fuse_partition_count)) {
+		/* cut at the end of an image shrunk since */
+		struct sparse_partition *partition = &sparse_fuse_partitions[ino - PARTITION_INO_BASE];
+		*base = partition->offset;
+		*length = MIN(partition->length, size > *base ? size - *base : 0);
+	} else if (sparse_fuse_options.passthrough &&
+		ino >= BAND_INO_BASE && ino < BAND_INO(sparse_fuse_band_count(state))) {
+		*base = (off_t)(ino - BAND_INO_BASE) * sparse_get_band_size(state);
+		*length = MIN((off_t)sparse_get_band_size(state), size - *base);
+	} else {
+		return -ENOENT;
+	}
+	return 0;
+}
+
+/* waits until the bundle is neither opening nor closing. locking: sparse_fuse_bundle_lock required */
+static void sparse_fuse_wait(struct sparse_fuse_bundle *bundle)
+{
+	while (bundle->busy) {
+		pthread_cond_wait(&sparse_fuse_bundle_done, &sparse_fuse_bundle_lock);
+	}
+}
+
+/* locking: sparse_fuse_bundle_lock required, bundle must be busy */
+static void sparse_fuse_done(struct sparse_fuse_bundle *bundle, sparse_handle_t state)
+{
+	bundle->state = state;
+	bundle->busy = 0;
+	pthread_cond_broadcast(&sparse_fuse_bundle_done);
+}
+
+/*
+  takes a reference on the bundle behind ino, opening it if it is closed,
+  and finds where the file lies in its image. sparse_fuse_put drops it.
+*/
+static int sparse_fuse_get(fuse_ino_t ino, struct sparse_fuse_bundle **bundle_ptr, off_t *base, off_t *length)
+{
+	pthread_mutex_lock(&sparse_fuse_bundle_lock);
+	struct sparse_fuse_bundle *bundle = sparse_fuse_bundle_of(ino);
+	if (bundle == NULL) {
+		pthread_mutex_unlock(&sparse_fuse_bundle_lock);
+		return -ENOENT;
+	}
+	sparse_fuse_wait(bundle);
+	if (bundle->state == NULL) {
+		/* opening lists the bands, requests on other bundles go on meanwhile */
+		sparse_handle_t state = NULL;
+		struct sparse_options options = sparse_fuse_options.options;
+		options.path = bundle->path;
+		bundle->busy = 1;
+		pthread_mutex_unlock(&sparse_fuse_bundle_lock);
+		int r = 0;
+		if (sparse_open(&state, &options)) {
+			r = access(bundle->path, F_OK) ? -ENOENT : -EIO;
+			fprintf(stderr, "sparsebundle: %s: %s\n", bundle->path, sparse_get_error(NULL));
+		}
+		pthread_mutex_lock(&sparse_fuse_bundle_lock);
+		sparse_fuse_done(bundle, state);
+		if (r < 0) {
+			pthread_mutex_unlock(&sparse_fuse_bundle_lock);
+			return r;
+		}
+	}
+	int r = sparse_fuse_window(bundle->state, ino, base, length);
+	if (r == 0) {
+		bundle->refs++;
+		*bundle_ptr = bundle;
+	}
+	bundle->last_used = sparse_fuse_now();
+	pthread_mutex_unlock(&sparse_fuse_bundle_lock);
+	return r;
+}
+
+static void sparse_fuse_put(struct sparse_fuse_bundle *bundle)
+{
+	pthread_mutex_lock(&sparse_fuse_bundle_lock);
+	bundle->refs--;
+	bundle->last_used = sparse_fuse_now();
+	pthread_mutex_unlock(&sparse_fuse_bundle_lock);
+}
+
+/*
+  syncs and closes bundles idle for --idle-timeout seconds, until told to
+  stop. a bundle that fails to sync stays open, its writes are not lost
+  and the next round tries again. the bundle is busy while it is closed,
+  so it is never open twice.
+*/
+static void *sparse_fuse_reaper(void *arg)
+{
+	struct timespec deadline;
+	pthread_mutex_lock(&sparse_fuse_bundle_lock);
+	while (!sparse_fuse_reaper_stop) {
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_sec++;
+		pthread_cond_timedwait(&sparse_fuse_reaper_wake, &sparse_fuse_bundle_lock, &deadline);
+		time_t now = sparse_fuse_now();
+		for (int i = 0; i < sparse_fuse_bundle_count; i++) {
+			struct sparse_fuse_bundle *bundle = sparse_fuse_bundles[i];
+			if (bundle->state == NULL || bundle->busy || bundle->refs > 0 ||
+				now - bundle->last_used < sparse_fuse_options.idle_timeout) {
+				continue;
+			}
+			sparse_handle_t state = bundle->state;
+			struct sparse_usage usage;
+			size_t size = 0;
+			bundle->state = NULL;
+			bundle->busy = 1;
+			pthread_mutex_unlock(&sparse_fuse_bundle_lock);
+			int r = sparse_sync(state, 0);
+			if (r < 0) {
+				fprintf(stderr, "sparsebundle: %s: unable to sync, keeping it open: %s\n", bundle->path, strerror(-r));
+			} else {
+				sparse_get_usage(state, &usage);
+				size = sparse_get_size(state);
+				sparse_close(&state);
+			}
+			pthread_mutex_lock(&sparse_fuse_bundle_lock);
+			if (state == NULL) {
+				bundle->usage = usage;
+				bundle->size = size;
+			}
+			bundle->last_used = sparse_fuse_now();
+			sparse_fuse_done(bundle, state);
+		}
+	}
+	pthread_mutex_unlock(&sparse_fuse_bundle_lock);
+	return NULL;
+}
+
+/*
+  several bundles: the size and space of an image, without opening its
+  bundle for a lookup. a closed bundle has its size read from Info.plist,
+  and the space it took when it was last closed.
+*/
+static int sparse_fuse_stat_bundle(fuse_ino_t ino, struct stat *stbuf)
+{
+	struct sparse_usage usage;
+	uint64_t size;
+	pthread_mutex_lock(&sparse_fuse_bundle_lock);
+	struct sparse_fuse_bundle *bundle = sparse_fuse_bundle_of(ino);
+	if (bundle == NULL) {
+		pthread_mutex_unlock(&sparse_fuse_bundle_lock);
+		return -ENOENT;
+	}
+	if (bundle->state != NULL) {
+		sparse_get_usage(bundle->state, &usage);
+		size = sparse_get_size(bundle->state);
+		pthread_mutex_unlock(&sparse_fuse_bundle_lock);
+	} else {
+		/* bundles are never freed, neither is their path */
+		const char *path = bundle->path;
+		usage = bundle->usage;
+		pthread_mutex_unlock(&sparse_fuse_bundle_lock);
+		int r = sparse_read_size(path, &size);
+		if (r < 0) {
+			return r == -ENOENT ? r : -EIO;
+		}
+	}
+	stbuf->st_size = size;
+	stbuf->st_blocks = usage.allocated / 512;
+	return 0;
+}
 
-static int sparse_fuse_getattr(const char *path, struct stat *stbuf)
+static int sparse_fuse_stat(fuse_ino_t ino, struct stat *stbuf)
 {
-	int res = 0;
 	memset(stbuf, 0, sizeof(struct stat));
-	if (strcmp(path, "/") == 0) {
+	stbuf->st_ino = ino;
+	stbuf->st_uid = getuid();
+	stbuf->st_gid = getgid();
+	if (ino == ROOT_INO) {
 		stbuf->st_mode = S_IFDIR | 0555;
-		stbuf->st_uid = getuid();
-		stbuf->st_gid = getgid();
 		stbuf->st_nlink = 2;
-	} else if (strcmp(path+1, sparse_fuse_options.filename) == 0) {
-		stbuf->st_mode = S_IFREG | 0666;
-		stbuf->st_uid = getuid();
-		stbuf->st_gid = getgid();
+	} else if (ino == BANDS_INO && sparse_fuse_options.passthrough) {
+		stbuf->st_mode = S_IFDIR | 0555;
+		stbuf->st_nlink = 2;
+	} else if (ino == STATS_INO) {
+		/* no size, it is read with direct_io */
+		stbuf->st_mode = S_IFREG | 0444;
+		stbuf->st_nlink = 1;
+	} else if (sparse_fuse_multi) {
+		int r = sparse_fuse_stat_bundle(ino, stbuf);
+		if (r < 0) {
+			return r;
+		}
+		stbuf->st_mode = S_IFREG | (sparse_fuse_options.options.read_only ? 0444 : 0666);
 		stbuf->st_nlink = 1;
-		stbuf->st_size = sparse_get_size(sparse_state);
 	} else {
-		res = -ENOENT;
+		struct sparse_fuse_bundle *bundle;
+		off_t base;
+		int r = sparse_fuse_get(ino, &bundle, &base, &stbuf->st_size);
+		if (r < 0) {
+			return r;
+		}
+		if (sparse_fuse_is_image(ino)) {
+			/* partitions and bands cannot tell their share */
+			struct sparse_usage usage;
+			sparse_get_usage(bundle->state, &usage);
+			stbuf->st_blocks = usage.allocated / 512;
+		}
+		sparse_fuse_put(bundle);
+		stbuf->st_mode = S_IFREG | (sparse_fuse_options.options.read_only ? 0444 : 0666);
+		stbuf->st_nlink = 1;
 	}
-	return res;
+	return 0;
 }
 
-static int sparse_fuse_readdir(
-	const char *path, void *buf, fuse_fill_dir_t filler,
-	off_t offset, struct fuse_file_info *fi)
+static void sparse_fuse_init(void *userdata, struct fuse_conn_info *conn)
 {
-	(void) offset;
-	(void) fi;
+	/* whole bands move in few requests, reads go out in parallel */
+	conn->max_write = MAX_IO_SIZE;
+	conn->max_readahead = MAX_IO_SIZE;
+	if (conn->capable & FUSE_CAP_ASYNC_READ) {
+		conn->want |= FUSE_CAP_ASYNC_READ;
+	}
+	/* band fds can be spliced unless they are mapped or O_DIRECT */
+	if (!sparse_fuse_options.no_splice &&
+		!sparse_fuse_options.options.mmap_bands && !sparse_fuse_options.options.direct_io) {
+		conn->want |= conn->capable & (FUSE_CAP_SPLICE_READ | FUSE_CAP_SPLICE_WRITE | FUSE_CAP_SPLICE_MOVE);
+	}
+	/* nobody else changes the image, the kernel may cache it all */
+	if (sparse_fuse_options.writeback_cache && (conn->capable & FUSE_CAP_WRITEBACK_CACHE)) {
+		conn->want |= FUSE_CAP_WRITEBACK_CACHE;
+	}
+#ifdef FUSE_CAP_PASSTHROUGH
+	if (sparse_fuse_options.passthrough && (conn->capable & FUSE_CAP_PASSTHROUGH)) {
+		conn->want |= FUSE_CAP_PASSTHROUGH;
+		sparse_fuse_passthrough = 1;
+	}
+#endif
+}
 
-	if (strcmp(path, "/") != 0)
-		return -ENOENT;
+/* several bundles: inode of an image file, 0 if there is none */
+static fuse_ino_t sparse_fuse_bundle_ino(const char *name)
+{
+	fuse_ino_t ino = 0;
+	pthread_mutex_lock(&sparse_fuse_bundle_lock);
+	struct sparse_fuse_bundle *bundle = sparse_fuse_find_bundle(name);
+	size_t length = strlen(name);
+	if ((bundle == NULL || bundle->gone) && sparse_fuse_options.directory != NULL &&
+		length > strlen(IMAGE_SUFFIX) && strcmp(name + length - strlen(IMAGE_SUFFIX), IMAGE_SUFFIX) == 0) {
+		/* the bundle may have been added since the directory was listed */
+		sparse_fuse_scan();
+		bundle = sparse_fuse_find_bundle(name);
+	}
+	for (int i = 0; bundle != NULL && !bundle->gone && i < sparse_fuse_bundle_count; i++) {
+		if (sparse_fuse_bundles[i] == bundle) {
+			ino = BUNDLE_INO(i);
+		}
+	}
+	pthread_mutex_unlock(&sparse_fuse_bundle_lock);
+	return ino;
+}
 
-	filler(buf, ".", NULL, 0);
-	filler(buf, "..", NULL, 0);
-	filler(buf, sparse_fuse_options.filename, NULL, 0);
+static void sparse_fuse_lookup(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+	struct fuse_entry_param e;
+	memset(&e, 0, sizeof(e));
+	if (parent == ROOT_INO && strcmp(name, STATS_NAME) == 0) {
+		e.ino = STATS_INO;
+	} else if (sparse_fuse_multi) {
+		if (parent == ROOT_INO) {
+			e.ino = sparse_fuse_bundle_ino(name);
+		}
+	} else if (parent == ROOT_INO && strcmp(name, sparse_fuse_options.filename) == 0) {
+		e.ino = IMAGE_INO;
+	} else if (parent == ROOT_INO && strcmp(name, "bands") == 0) {
+		e.ino = BANDS_INO;
+	} else if (parent == ROOT_INO && name[0] == 's') {
+		for (int i = 0; i < sparse_fuse_partition_count; i++) {
+			char partition_name[16];
+			snprintf(partition_name, sizeof(partition_name), "s%d", sparse_fuse_partitions[i].number);
+			if (strcmp(name, partition_name) == 0) {
+				e.ino = PARTITION_INO(i);
+				break;
+			}
+		}
+	} else if (parent == BANDS_INO) {
+		/* band files are named like in the bundle, lowercase hex */
+		char canonical[32];
+		char *end;
+		unsigned long id = strtoul(name, &end, 16);
+		snprintf(canonical, sizeof(canonical), "%lx", id);
+		if (*end == '\0' && strcmp(name, canonical) == 0) {
+			e.ino = BAND_INO(id);
+		}
+	}
+	int r = e.ino == 0 ? -ENOENT : sparse_fuse_stat(e.ino, &e.attr);
+	if (r < 0) {
+		fuse_reply_err(req, -r);
+		return;
+	}
+	e.attr_timeout = sparse_fuse_options.attr_timeout;
+	e.entry_timeout = sparse_fuse_options.attr_timeout;
+	fuse_reply_entry(req, &e);
+}
 
-	return 0;
+static void sparse_fuse_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	struct stat stbuf;
+	int r = sparse_fuse_stat(ino, &stbuf);
+	if (r < 0) {
+		fuse_reply_err(req, -r);
+		return;
+	}
+	fuse_reply_attr(req, &stbuf, sparse_fuse_options.attr_timeout);
 }
 
-static int sparse_fuse_open(const char *path, struct fuse_file_info *fi)
+static void sparse_fuse_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr, int to_set, struct fuse_file_info *fi)
 {
-	if (fi->flags & O_CREAT || fi->flags & O_TRUNC)
-		return -EACCES;
+	struct stat stbuf;
+	if (!sparse_fuse_is_image(ino)) {
+		fuse_reply_err(req, EPERM);
+		return;
+	}
+	/* only the size can change, the rest is fixed */
+	if ((to_set & FUSE_SET_ATTR_SIZE) && __atomic_load_n(&sparse_fuse_backed, __ATOMIC_RELAXED)) {
+		/* a resize changes the length of the last band and trims those past the end */
+		fuse_reply_err(req, EBUSY);
+		return;
+	}
+	if (to_set & FUSE_SET_ATTR_SIZE) {
+		struct sparse_fuse_bundle *bundle;
+		off_t base, length;
+		int r = sparse_fuse_get(ino, &bundle, &base, &length);
+		if (r == 0) {
+			r = sparse_resize(bundle->state, attr->st_size);
+			sparse_fuse_put(bundle);
+		}
+		if (r < 0) {
+			fuse_reply_err(req, -r);
+			return;
+		}
+	}
+	int r = sparse_fuse_stat(ino, &stbuf);
+	if (r < 0) {
+		fuse_reply_err(req, -r);
+		return;
+	}
+	fuse_reply_attr(req, &stbuf, sparse_fuse_options.attr_timeout);
+}
 
-	if (strcmp(path+1, sparse_fuse_options.filename) != 0)
-		return -ENOENT;
+/*
+  the i-th entry of a directory, NULL past the last one and "" for an entry
+  that is gone but keeps its place
+*/
+static const char *sparse_fuse_dirent(fuse_ino_t ino, off_t i, char *name, size_t name_size, struct stat *stbuf)
+{
+	if (i < 2) {
+		stbuf->st_ino = i == 0 ? ino : ROOT_INO;
+		stbuf->st_mode = S_IFDIR;
+		return i == 0 ? "." : "..";
+	}
+	if (ino == ROOT_INO) {
+		if (i == 2) {
+			stbuf->st_ino = STATS_INO;
+			stbuf->st_mode = S_IFREG;
+			return STATS_NAME;
+		}
+		/* the rest is numbered as if it were not there */
+		i--;
+	}
+	if (sparse_fuse_multi) {
+		const char *entry = NULL;
+		pthread_mutex_lock(&sparse_fuse_bundle_lock);
+		if (i - 2 < sparse_fuse_bundle_count) {
+			struct sparse_fuse_bundle *bundle = sparse_fuse_bundles[i - 2];
+			snprintf(name, name_size, "%s", bundle->gone ? "" : bundle->name);
+			stbuf->st_ino = BUNDLE_INO(i - 2);
+			stbuf->st_mode = S_IFREG;
+			entry = name;
+		}
+		pthread_mutex_unlock(&sparse_fuse_bundle_lock);
+		return entry;
+	}
+	if (ino == ROOT_INO && i == 2) {
+		stbuf->st_ino = IMAGE_INO;
+		stbuf->st_mode = S_IFREG;
+		return sparse_fuse_options.filename;
+	}
+	if (ino == ROOT_INO && i == 3 && sparse_fuse_options.passthrough) {
+		stbuf->st_ino = BANDS_INO;
+		stbuf->st_mode = S_IFDIR;
+		return "bands";
+	}
+	off_t partition = i - (sparse_fuse_options.passthrough ? 4 : 3);
+	if (ino == ROOT_INO && partition < sparse_fuse_partition_count) {
+		snprintf(name, name_size, "s%d", sparse_fuse_partitions[partition].number);
+		stbuf->st_ino = PARTITION_INO(partition);
+		stbuf->st_mode = S_IFREG;
+		return name;
+	}
+	if (ino == BANDS_INO && i - 2 < sparse_fuse_band_count(sparse_fuse_bundles[0]->state)) {
+		snprintf(name, name_size, "%lx", (unsigned long)(i - 2));
+		stbuf->st_ino = BAND_INO(i - 2);
+		stbuf->st_mode = S_IFREG;
+		return name;
+	}
+	return NULL;
+}
+
+static void sparse_fuse_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset, struct fuse_file_info *fi)
+{
+	struct stat stbuf = {0};
+	char name[NAME_MAX + 1];
+	const char *entry_name;
+	char *buf;
+	size_t length = 0;
+
+	if (ino != ROOT_INO && !(ino == BANDS_INO && sparse_fuse_options.passthrough)) {
+		fuse_reply_err(req, ENOTDIR);
+		return;
+	}
+
+	if (sparse_fuse_options.directory != NULL && offset == 0) {
+		/* each listing picks up bundles added or removed since */
+		pthread_mutex_lock(&sparse_fuse_bundle_lock);
+		sparse_fuse_scan();
+		pthread_mutex_unlock(&sparse_fuse_bundle_lock);
+	}
+
+	buf = malloc(size);
+	for (off_t i = offset; (entry_name = sparse_fuse_dirent(ino, i, name, sizeof(name), &stbuf)) != NULL; i++) {
+		if (entry_name[0] == '\0') {
+			continue;
+		}
+		size_t entry = fuse_add_direntry(req, buf + length, size - length, entry_name, &stbuf, i + 1);
+		if (entry > size - length) {
+			break;
+		}
+		length += entry;
+	}
+	fuse_reply_buf(req, buf, length);
+	free(buf);
+}
+
+/* an open file, in fi->fh. it holds a reference on its bundle. */
+struct sparse_fuse_handle {
+	struct sparse_fuse_bundle *bundle;
+	/* --passthrough: the band file the kernel serves it from, 0 if none */
+	int backing_id;
+	/* kept for fsync, which still comes to us */
+	int fd;
+	/* the stats file, which has no bundle, as it was when opened */
+	char *stats;
+	size_t stats_size;
+};
+
+#define HANDLE(fi) ((struct sparse_fuse_handle *)(uintptr_t)(fi)->fh)
+
+#ifdef FUSE_CAP_PASSTHROUGH
+/*
+  hands the band file behind ino to the kernel, so that I/O on it never
+  reaches us. the image qualifies only while it fits in one band.
+  leaves backing_id at 0 to serve the file as usual.
+*/
+static void sparse_fuse_open_backing(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi, struct sparse_fuse_handle *handle)
+{
+	sparse_handle_t state = handle->bundle->state;
+	off_t base, length;
+	int write = (fi->flags & O_ACCMODE) != O_RDONLY;
+	if (!sparse_fuse_passthrough || (ino < BAND_INO_BASE && ino != IMAGE_INO)) {
+		/* partitions do not line up with band files */
+		return;
+	}
+	if (sparse_fuse_window(state, ino, &base, &length)) {
+		return;
+	}
+	if (ino == IMAGE_INO && (length == 0 || length > (off_t)sparse_get_band_size(state))) {
+		return;
+	}
+	int fd = sparse_open_band_file(state, base / sparse_get_band_size(state), write);
+	if (fd < 0) {
+		/* missing or short bands are read through the library */
+		return;
+	}
+	int backing_id = fuse_passthrough_open(req, fd);
+	if (backing_id <= 0) {
+		close(fd);
+		return;
+	}
+	handle->backing_id = backing_id;
+	handle->fd = fd;
+}
+#endif
 
+/*
+  statistics of the open bundles, closed ones have none to give. reading
+  them does not count as use, scrapes do not keep bundles open.
+*/
+static int sparse_fuse_stats(char **buf, size_t *size)
+{
+	FILE *f = open_memstream(buf, size);
+	if (f == NULL) {
+		return -errno;
+	}
+	pthread_mutex_lock(&sparse_fuse_bundle_lock);
+	struct sparse_fuse_bundle **held = malloc((sparse_fuse_bundle_count + 1) * sizeof(*held));
+	sparse_handle_t *states = malloc((sparse_fuse_bundle_count + 1) * sizeof(*states));
+	const char **names = malloc((sparse_fuse_bundle_count + 1) * sizeof(*names));
+	int count = 0;
+	for (int i = 0; i < sparse_fuse_bundle_count; i++) {
+		struct sparse_fuse_bundle *bundle = sparse_fuse_bundles[i];
+		if (bundle->gone || bundle->state == NULL) {
+			continue;
+		}
+		bundle->refs++;
+		held[count] = bundle;
+		states[count] = bundle->state;
+		names[count] = bundle->name;
+		count++;
+	}
+	pthread_mutex_unlock(&sparse_fuse_bundle_lock);
+	int r = sparse_dump_prometheus(f, states, sparse_fuse_multi ? names : NULL, count);
+	pthread_mutex_lock(&sparse_fuse_bundle_lock);
+	for (int i = 0; i < count; i++) {
+		held[i]->refs--;
+	}
+	pthread_mutex_unlock(&sparse_fuse_bundle_lock);
+	if (fclose(f) && r == 0) {
+		r = -errno;
+	}
+	free(held);
+	free(states);
+	free(names);
+	return r;
+}
+
+static void sparse_fuse_open_stats(fuse_req_t req, struct fuse_file_info *fi)
+{
+	if ((fi->flags & O_ACCMODE) != O_RDONLY) {
+		fuse_reply_err(req, EACCES);
+		return;
+	}
+	struct sparse_fuse_handle *handle = calloc(1, sizeof(*handle));
+	handle->fd = -1;
+	int r = sparse_fuse_stats(&handle->stats, &handle->stats_size);
+	if (r < 0) {
+		free(handle->stats);
+		free(handle);
+		fuse_reply_err(req, -r);
+		return;
+	}
+	fi->fh = (uintptr_t)handle;
+	/* the size is only known now */
+	fi->direct_io = 1;
+	fuse_reply_open(req, fi);
+}
+
+static void sparse_fuse_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	struct sparse_fuse_bundle *bundle;
+	off_t base, length;
+	if (ino == STATS_INO) {
+		sparse_fuse_open_stats(req, fi);
+		return;
+	}
+	int r = sparse_fuse_get(ino, &bundle, &base, &length);
+	if (r < 0) {
+		fuse_reply_err(req, ino == ROOT_INO || ino == BANDS_INO ? EISDIR : -r);
+		return;
+	}
+
+	if (fi->flags & O_CREAT || fi->flags & O_TRUNC) {
+		sparse_fuse_put(bundle);
+		fuse_reply_err(req, EACCES);
+		return;
+	}
+
+	struct sparse_fuse_handle *handle = calloc(1, sizeof(*handle));
+	handle->bundle = bundle;
+	handle->fd = -1;
+	fi->fh = (uintptr_t)handle;
+	fi->keep_cache = sparse_fuse_options.keep_cache;
+#ifdef FUSE_CAP_PASSTHROUGH
+	sparse_fuse_open_backing(req, ino, fi, handle);
+	if (handle->backing_id > 0) {
+		fi->backing_id = handle->backing_id;
+		__atomic_add_fetch(&sparse_fuse_backed, 1, __ATOMIC_RELAXED);
+	}
+#endif
+	fuse_reply_open(req, fi);
+}
+
+static void sparse_fuse_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	struct sparse_fuse_handle *handle = HANDLE(fi);
+#ifdef FUSE_CAP_PASSTHROUGH
+	if (handle->backing_id > 0) {
+		fuse_passthrough_close(req, handle->backing_id);
+		close(handle->fd);
+		__atomic_sub_fetch(&sparse_fuse_backed, 1, __ATOMIC_RELAXED);
+	}
+#endif
+	if (handle->bundle != NULL) {
+		sparse_fuse_put(handle->bundle);
+	}
+	free(handle->stats);
+	free(handle);
+	fuse_reply_err(req, 0);
+}
+
+/* band segments for zero copy I/O, -ENOTSUP to copy instead */
+static int sparse_fuse_segments(sparse_handle_t state, size_t size, off_t offset, int write, struct sparse_segment *segments)
+{
+	if (sparse_fuse_options.no_splice || size > MAX_IO_SIZE) {
+		return -ENOTSUP;
+	}
+	int n = sparse_get_segments(state, size, offset, write, segments, MAX_SEGMENTS);
+	return n == -E2BIG ? -ENOTSUP : n;
+}
+
+/* replies with band file ranges, which libfuse splices into /dev/fuse */
+static void sparse_fuse_reply_segments(fuse_req_t req, struct sparse_segment *segments, int count)
+{
+	struct fuse_bufvec *bufv = calloc(1, sizeof(struct fuse_bufvec) + count * sizeof(struct fuse_buf));
+	bufv->count = count;
+	for (int i = 0; i < count; i++) {
+		struct fuse_buf *buf = &bufv->buf[i];
+		buf->size = segments[i].size;
+		buf->fd = segments[i].fd;
+		if (segments[i].fd >= 0) {
+			buf->flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+			buf->pos = segments[i].offset;
+		} else {
+			buf->mem = sparse_zeros;
+		}
+	}
+	fuse_reply_data(req, bufv, FUSE_BUF_SPLICE_MOVE);
+	free(bufv);
+}
+
+static void sparse_fuse_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset, struct fuse_file_info *fi)
+{
+	struct sparse_segment segments[MAX_SEGMENTS];
+	struct sparse_fuse_handle *handle = HANDLE(fi);
+	if (handle->bundle == NULL) {
+		/* the stats file */
+		size_t stats_offset = MIN((size_t)offset, handle->stats_size);
+		fuse_reply_buf(req, handle->stats + stats_offset, MIN(size, handle->stats_size - stats_offset));
+		return;
+	}
+	sparse_handle_t state = handle->bundle->state;
+	off_t base, end;
+	if (sparse_fuse_window(state, ino, &base, &end)) {
+		fuse_reply_err(req, ENOENT);
+		return;
+	}
+	size = offset < end ? MIN(size, end - offset) : 0;
+	if (size == 0) {
+		fuse_reply_buf(req, NULL, 0);
+		return;
+	}
+	offset += base;
+	int r = sparse_fuse_segments(state, size, offset, 0, segments);
+	if (r >= 0) {
+		sparse_fuse_reply_segments(req, segments, r);
+		sparse_put_segments(state, segments, r);
+		return;
+	}
+	if (r != -ENOTSUP) {
+		fuse_reply_err(req, -r);
+		return;
+	}
+	char *buf = malloc(size);
+	r = sparse_pread(state, buf, size, offset);
+	if (r < 0) {
+		fuse_reply_err(req, -r);
+	} else {
+		fuse_reply_buf(req, buf, r);
+	}
+	free(buf);
+}
+
+/*
+  --keep-cache: partitions show bytes of the image, so what the kernel
+  keeps of one goes stale when the other is written. drops the written
+  range, given in the image, from every other file it shows up in.
+*/
+static void sparse_fuse_written(fuse_ino_t ino, off_t offset, off_t length)
+{
+	struct fuse_session *se = sparse_fuse_session;
+	if (!sparse_fuse_options.keep_cache || sparse_fuse_multi || se == NULL || length <= 0) {
+		return;
+	}
+	if (ino != IMAGE_INO) {
+		fuse_lowlevel_notify_inval_inode(se, IMAGE_INO, offset, length);
+	}
+	for (int i = 0; i < sparse_fuse_partition_count; i++) {
+		struct sparse_partition *partition = &sparse_fuse_partitions[i];
+		off_t start = offset > partition->offset ? offset : partition->offset;
+		off_t end = MIN(offset + length, partition->offset + partition->length);
+		if (PARTITION_INO(i) != ino && start < end) {
+			fuse_lowlevel_notify_inval_inode(se, PARTITION_INO(i), start - partition->offset, end - start);
+		}
+	}
+}
+
+/* write through the library, for when the data cannot be spliced */
+static ssize_t sparse_fuse_write_copy(sparse_handle_t state, struct fuse_bufvec *in, size_t size, off_t offset)
+{
+	if (in->count == 1 && !(in->buf[0].flags & FUSE_BUF_IS_FD)) {
+		return sparse_pwrite(state, in->buf[0].mem, size, offset);
+	}
+	struct fuse_bufvec mem = FUSE_BUFVEC_INIT(size);
+	mem.buf[0].mem = malloc(size);
+	ssize_t r = fuse_buf_copy(&mem, in, 0);
+	if (r >= 0) {
+		r = sparse_pwrite(state, mem.buf[0].mem, r, offset);
+	}
+	free(mem.buf[0].mem);
+	return r;
+}
+
+static void sparse_fuse_write_buf(fuse_req_t req, fuse_ino_t ino, struct fuse_bufvec *in, off_t offset, struct fuse_file_info *fi)
+{
+	struct sparse_segment segments[MAX_SEGMENTS];
+	size_t size = fuse_buf_size(in);
+	sparse_handle_t state = HANDLE(fi)->bundle->state;
+	ssize_t r = 0;
+	off_t base, end;
+	if (sparse_fuse_window(state, ino, &base, &end)) {
+		fuse_reply_err(req, ENOENT);
+		return;
+	}
+	if (!sparse_fuse_is_image(ino) && offset + (off_t)size > end) {
+		/* band files are fixed in size */
+		fuse_reply_err(req, EFBIG);
+		return;
+	}
+	offset += base;
+	int n = sparse_fuse_segments(state, size, offset, 1, segments);
+	if (n == -ENOTSUP) {
+		r = sparse_fuse_write_copy(state, in, size, offset);
+	} else if (n < 0) {
+		r = n;
+	} else {
+		/* fuse_buf_copy consumes in as it goes, one band at a time */
+		for (int i = 0; i < n && r >= 0; i++) {
+			struct fuse_bufvec out = FUSE_BUFVEC_INIT(segments[i].size);
+			out.buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+			out.buf[0].fd = segments[i].fd;
+			out.buf[0].pos = segments[i].offset;
+			ssize_t copied = fuse_buf_copy(&out, in, 0);
+			if (copied < 0) {
+				r = copied;
+			} else if ((size_t) copied < segments[i].size) {
+				r = -EIO;
+			} else {
+				r += copied;
+			}
+		}
+		sparse_put_segments(state, segments, n);
+	}
+	if (r < 0) {
+		fuse_reply_err(req, -r);
+	} else {
+		sparse_fuse_written(ino, offset, r);
+		fuse_reply_write(req, r);
+	}
+}
+
+#if defined(FALLOC_FL_PUNCH_HOLE) && defined(FALLOC_FL_ZERO_RANGE)
+static void sparse_fuse_fallocate(fuse_req_t req, fuse_ino_t ino, int mode, off_t offset, off_t length, struct fuse_file_info *fi)
+{
+	sparse_handle_t state = HANDLE(fi)->bundle->state;
+	off_t base, end;
+	int flags = 0, r;
+	if (sparse_fuse_window(state, ino, &base, &end)) {
+		fuse_reply_err(req, ENOENT);
+		return;
+	}
+	if (mode == (FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE)) {
+		flags = SPARSE_ZERO_MAY_TRIM;
+		if (sparse_fuse_passthrough) {
+			/* the kernel may hold band files we would otherwise remove */
+			flags |= SPARSE_ZERO_KEEP_BANDS;
+		}
+	} else if ((mode & ~FALLOC_FL_KEEP_SIZE) != FALLOC_FL_ZERO_RANGE ||
+		(!(mode & FALLOC_FL_KEEP_SIZE) && offset + length > end)) {
+		/* the image is sparse already and never grows this way */
+		fuse_reply_err(req, EOPNOTSUPP);
+		return;
+	}
+	length = offset < end ? MIN(length, end - offset) : 0;
+	r = length > 0 ? sparse_zero(state, length, base + offset, flags) : 0;
+	if (r >= 0) {
+		sparse_fuse_written(ino, base + offset, length);
+	}
+	fuse_reply_err(req, r < 0 ? -r : 0);
+}
+#endif
+
+#ifdef SEEK_DATA
+struct sparse_fuse_seek {
+	int hole;
+	off_t found;
+};
+
+static int sparse_fuse_seek_extent(void *opaque, off_t offset, size_t length, int flags)
+{
+	struct sparse_fuse_seek *seek = opaque;
+	if (!(flags & SPARSE_EXTENT_HOLE) == !seek->hole) {
+		seek->found = offset;
+		return 1;
+	}
 	return 0;
 }
 
-static int sparse_fuse_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi)
+/* SEEK_DATA and SEEK_HOLE, answered from the band files */
+static void sparse_fuse_lseek(fuse_req_t req, fuse_ino_t ino, off_t offset, int whence, struct fuse_file_info *fi)
 {
-	if (strcmp(path+1, sparse_fuse_options.filename) != 0)
-		return -ENOENT;
+	struct sparse_fuse_handle *handle = HANDLE(fi);
+	off_t base, end;
+	struct sparse_fuse_seek seek = { whence == SEEK_HOLE, -1 };
+	if (handle->bundle == NULL) {
+		/* the stats file, all data */
+		end = handle->stats_size;
+		if (offset < 0 || offset >= end) {
+			fuse_reply_err(req, ENXIO);
+		} else {
+			fuse_reply_lseek(req, whence == SEEK_HOLE ? end : offset);
+		}
+		return;
+	}
+	sparse_handle_t state = handle->bundle->state;
+	if (sparse_fuse_window(state, ino, &base, &end)) {
+		fuse_reply_err(req, ENOENT);
+		return;
+	}
+	if (whence != SEEK_DATA && whence != SEEK_HOLE) {
+		fuse_reply_err(req, EINVAL);
+		return;
+	}
+	if (offset < 0 || offset >= end) {
+		fuse_reply_err(req, ENXIO);
+		return;
+	}
+	int r = sparse_extents(state, end - offset, base + offset, sparse_fuse_seek_extent, &seek);
+	if (r < 0) {
+		fuse_reply_err(req, -r);
+	} else if (seek.found >= 0) {
+		fuse_reply_lseek(req, seek.found - base);
+	} else if (seek.hole) {
+		/* there is always a hole at the end of the file */
+		fuse_reply_lseek(req, end);
+	} else {
+		fuse_reply_err(req, ENXIO);
+	}
+}
+#endif
 
-	return sparse_pread(sparse_state, buf, size, offset);
+/* a disk as large as the images, with the space the band files take in use */
+static void sparse_fuse_statfs(fuse_req_t req, fuse_ino_t ino)
+{
+	struct statvfs stbuf;
+	uint64_t size = 0, allocated = 0, files = 0;
+	pthread_mutex_lock(&sparse_fuse_bundle_lock);
+	for (int i = 0; i < sparse_fuse_bundle_count; i++) {
+		struct sparse_fuse_bundle *bundle = sparse_fuse_bundles[i];
+		if (bundle->gone) {
+			continue;
+		}
+		if (bundle->state != NULL) {
+			sparse_get_usage(bundle->state, &bundle->usage);
+			bundle->size = sparse_get_size(bundle->state);
+		}
+		/* bundles never opened count as empty */
+		size += bundle->size;
+		allocated += bundle->usage.allocated;
+		files++;
+	}
+	pthread_mutex_unlock(&sparse_fuse_bundle_lock);
+	memset(&stbuf, 0, sizeof(stbuf));
+	stbuf.f_bsize = STATFS_BLOCK_SIZE;
+	stbuf.f_frsize = STATFS_BLOCK_SIZE;
+	stbuf.f_blocks = (size + STATFS_BLOCK_SIZE - 1) / STATFS_BLOCK_SIZE;
+	stbuf.f_bfree = size > allocated ? (size - allocated) / STATFS_BLOCK_SIZE : 0;
+	stbuf.f_bavail = stbuf.f_bfree;
+	stbuf.f_files = files + sparse_fuse_partition_count;
+	stbuf.f_namemax = NAME_MAX;
+	if (sparse_fuse_options.options.read_only) {
+		stbuf.f_flag = ST_RDONLY;
+	}
+	fuse_reply_statfs(req, &stbuf);
 }
 
-static int sparse_fuse_write(const char *path, const char *buf, size_t size, off_t offset, struct fuse_file_info *fi)
+/* every close() sends one, durability is left to fsync */
+static void sparse_fuse_flush(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
 {
-	if (strcmp(path+1, sparse_fuse_options.filename) != 0)
-		return -ENOENT;
+	fuse_reply_err(req, 0);
+}
 
-	return sparse_pwrite(sparse_state, buf, size, offset);
+static void sparse_fuse_fsync(fuse_req_t req, fuse_ino_t ino, int datasync, struct fuse_file_info *fi)
+{
+	struct sparse_fuse_handle *handle = HANDLE(fi);
+	int r = 0;
+	if (handle->bundle == NULL) {
+		/* the stats file */
+		fuse_reply_err(req, 0);
+		return;
+	}
+	if (handle->fd >= 0 && (datasync ? fdatasync(handle->fd) : fsync(handle->fd))) {
+		/* the kernel wrote to the band file behind our back */
+		r = -errno;
+	}
+	int s = sparse_sync(handle->bundle->state, datasync);
+	fuse_reply_err(req, r < 0 ? -r : s < 0 ? -s : 0);
 }
 
-static int sparse_fuse_flush(const char *path, struct fuse_file_info *fi)
+static void sparse_fuse_fsyncdir(fuse_req_t req, fuse_ino_t ino, int datasync, struct fuse_file_info *fi)
 {
-	if (strcmp(path+1, sparse_fuse_options.filename) != 0)
-		return -ENOENT;
+	int r = 0;
+	/* closed bundles were synced when they were closed */
+	pthread_mutex_lock(&sparse_fuse_bundle_lock);
+	for (int i = 0; i < sparse_fuse_bundle_count; i++) {
+		struct sparse_fuse_bundle *bundle = sparse_fuse_bundles[i];
+		/* a bundle failing to sync as it closes stays open */
+		sparse_fuse_wait(bundle);
+		if (bundle->state == NULL) {
+			continue;
+		}
+		bundle->refs++;
+		pthread_mutex_unlock(&sparse_fuse_bundle_lock);
+		int s = sparse_sync(bundle->state, datasync);
+		r = r < 0 ? r : s;
+		pthread_mutex_lock(&sparse_fuse_bundle_lock);
+		bundle->refs--;
+	}
+	pthread_mutex_unlock(&sparse_fuse_bundle_lock);
+	fuse_reply_err(req, r < 0 ? -r : 0);
+}
 
-	return sparse_flush(sparse_state);
+/*
+  drops what the kernel cached about the old size of the files cut from
+  the image. images are only resized by setattr, the kernel already knows
+  about those, and notifying from within it could deadlock against its
+  own truncation.
+*/
+static void sparse_fuse_resized(sparse_handle_t state, size_t old_size, size_t size)
+{
+	struct fuse_session *se = sparse_fuse_session;
+	size_t band_size = sparse_get_band_size(state);
+	if (se == NULL || sparse_fuse_multi) {
+		/* several bundles serve neither partitions nor bands */
+		return;
+	}
+	for (int i = 0; i < sparse_fuse_partition_count; i++) {
+		/* partitions are cut at the end of the image */
+		fuse_lowlevel_notify_inval_inode(se, PARTITION_INO(i), -1, 0);
+	}
+	if (sparse_fuse_options.passthrough) {
+		/* the listing and the length of the last band changed */
+		fuse_lowlevel_notify_inval_inode(se, BANDS_INO, 0, 0);
+		fuse_lowlevel_notify_inval_inode(se, BAND_INO((old_size - 1) / band_size), -1, 0);
+		fuse_lowlevel_notify_inval_inode(se, BAND_INO((size - 1) / band_size), -1, 0);
+	}
 }
 
-static struct fuse_operations sparse_oper = {
+static const struct fuse_lowlevel_ops sparse_oper = {
+	.init		= sparse_fuse_init,
+	.lookup		= sparse_fuse_lookup,
 	.getattr	= sparse_fuse_getattr,
+	.setattr	= sparse_fuse_setattr,
 	.readdir	= sparse_fuse_readdir,
 	.open		= sparse_fuse_open,
+	.release	= sparse_fuse_release,
 	.read		= sparse_fuse_read,
-	.write		= sparse_fuse_write,
+	.write_buf	= sparse_fuse_write_buf,
 	.flush		= sparse_fuse_flush,
+	.fsync		= sparse_fuse_fsync,
+	.fsyncdir	= sparse_fuse_fsyncdir,
+	.statfs		= sparse_fuse_statfs,
+#if defined(FALLOC_FL_PUNCH_HOLE) && defined(FALLOC_FL_ZERO_RANGE)
+	.fallocate	= sparse_fuse_fallocate,
+#endif
+#ifdef SEEK_DATA
+	.lseek		= sparse_fuse_lseek,
+#endif
 };
 
 static int sparse_opt_proc(void *data, const char *arg, int key, struct fuse_args *outargs)
 {
 	switch (key) {
 		case FUSE_OPT_KEY_NONOPT:
-			if (!sparse_fuse_options.options.path) {
-				sparse_fuse_options.options.path = arg;
-				return 0;
-			}
+			/* the last one is the mountpoint, it goes back to fuse later */
+			sparse_fuse_options.paths = realloc(sparse_fuse_options.paths,
+				(sparse_fuse_options.path_count + 1) * sizeof(char *));
+			sparse_fuse_options.paths[sparse_fuse_options.path_count++] = (char *)arg;
+			return 0;
+		case KEY_RO:
+			/* keep the option, fuse needs it as well */
+			sparse_fuse_options.options.read_only = 1;
 			break;
 	}
 	return 1;
@@ -141,19 +1296,108 @@ static int sparse_opt_proc(void *data, const char *arg, int key, struct fuse_arg
 static void usage(const char *progname)
 {
 	printf(
-"usage: %s sparsebundle mountpoint [options]\n"
+"usage: %s sparsebundle... mountpoint [options]\n"
+"       %s --directory=DIR mountpoint [options]\n"
 "\n"
 "    -h   --help            print help\n"
 "    -f                     foreground operation\n"
 "    -s                     disable multi-threaded operation\n"
-"    --max-open-bands=N     maximum band files open (default: " xstr(DEFAULT_MAX_OPEN_BANDS) ")\n", progname);
+"    -o ro                  read only, bands are opened O_RDONLY\n"
+"    -o clone_fd            one /dev/fuse fd per worker thread\n"
+"    -o max_threads=N       maximum worker threads (libfuse 3.12 and later)\n"
+"    -o max_idle_threads=N  worker threads kept when idle\n"
+"    --name=NAME            image file name, one bundle only (default: " DEFAULT_FILENAME ")\n"
+"    --directory=DIR        serve every NAME" BUNDLE_SUFFIX " in DIR as NAME" IMAGE_SUFFIX "\n"
+"    --idle-timeout=SECS    close bundles unused this long, with several bundles\n"
+"                           (default: " xstr(IDLE_TIMEOUT) ")\n"
+"    --max-open-bands=N     maximum band files open, across all bundles\n"
+"                           (default: " xstr(DEFAULT_MAX_OPEN_BANDS) ")\n"
+"    --prealloc=POLICY      none, full, keep-size or truncate (default: none)\n"
+"    --mmap                 serve band I/O from memory mappings\n"
+"    --access=PATTERN       normal, sequential or random, hints for --mmap\n"
+"    --direct               open bands O_DIRECT, bypassing the page cache\n"
+"    --no-splice            copy data instead of splicing band files\n"
+"    --no-partitions        do not serve the partitions in the image as sN\n"
+"    --passthrough          experimental, expose bands under bands/ and hand\n"
+"                           band files to the kernel where it supports it\n"
+"    --writeback-cache      let the kernel cache writes, not with --passthrough\n"
+"    --keep-cache           keep cached data across opens\n"
+"    --attr-timeout=SECS    how long the kernel caches attributes (default: 1)\n", progname, progname);
+}
+
+static int sparse_fuse_loop(struct fuse_session *se, struct fuse_cmdline_opts *cmdline)
+{
+	if (cmdline->singlethread) {
+		return fuse_session_loop(se);
+	}
+#ifdef HAVE_FUSE_LOOP_CFG_CREATE
+	struct fuse_loop_config *config = fuse_loop_cfg_create();
+	fuse_loop_cfg_set_clone_fd(config, cmdline->clone_fd);
+	fuse_loop_cfg_set_idle_threads(config, cmdline->max_idle_threads);
+	fuse_loop_cfg_set_max_threads(config, cmdline->max_threads);
+	int r = fuse_session_loop_mt(se, config);
+	fuse_loop_cfg_destroy(config);
+	return r;
+#else
+	struct fuse_loop_config config = {
+		.clone_fd = cmdline->clone_fd,
+		.max_idle_threads = cmdline->max_idle_threads,
+	};
+	return fuse_session_loop_mt(se, &config);
+#endif
+}
+
+/* opens a single bundle before mounting, so that errors are seen */
+static int sparse_fuse_open_single(void)
+{
+	struct sparse_fuse_bundle *bundle = sparse_fuse_bundles[0];
+	if (sparse_open(&bundle->state, &sparse_fuse_options.options)) {
+		fprintf(stderr, "sparsebundle: %s\n", sparse_get_error(NULL));
+		return 1;
+	}
+	return 0;
+}
+
+/* the bundles to serve, from the command line or --directory */
+static int sparse_fuse_add_bundles(void)
+{
+	int r = 0;
+	pthread_mutex_lock(&sparse_fuse_bundle_lock);
+	if (!sparse_fuse_multi) {
+		sparse_fuse_options.options.path = sparse_fuse_options.paths[0];
+		sparse_fuse_add_bundle(sparse_fuse_options.paths[0], sparse_fuse_options.filename);
+	} else if (sparse_fuse_options.directory != NULL) {
+		r = sparse_fuse_scan();
+		if (r < 0) {
+			fprintf(stderr, "sparsebundle: unable to list %s: %s\n", sparse_fuse_options.directory, strerror(-r));
+		}
+	}
+	for (int i = 0; sparse_fuse_multi && r == 0 && i < sparse_fuse_options.path_count; i++) {
+		char *name = sparse_fuse_image_name(sparse_fuse_options.paths[i]);
+		if (name == NULL || sparse_fuse_find_bundle(name) != NULL) {
+			fprintf(stderr, "sparsebundle: %s: %s image name\n", sparse_fuse_options.paths[i],
+				name == NULL ? "invalid" : "duplicate");
+			r = -EINVAL;
+		} else {
+			sparse_fuse_add_bundle(sparse_fuse_options.paths[i], name);
+		}
+		free(name);
+	}
+	pthread_mutex_unlock(&sparse_fuse_bundle_lock);
+	return r < 0 ? 1 : 0;
 }
 
 int main(int argc, char *argv[])
 {
 	struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+	struct fuse_cmdline_opts cmdline;
+	struct fuse_session *se;
+	int r = 1;
 	sparse_fuse_options.filename = strdup(DEFAULT_FILENAME);
 	sparse_fuse_options.options.max_open_bands = DEFAULT_MAX_OPEN_BANDS;
+	sparse_fuse_options.options.resized = sparse_fuse_resized;
+	sparse_fuse_options.attr_timeout = ATTR_TIMEOUT;
+	sparse_fuse_options.idle_timeout = IDLE_TIMEOUT;
 	if (fuse_opt_parse(&args, &sparse_fuse_options, option_spec, sparse_opt_proc) == -1) {
 		return 1;
 	}
@@ -163,10 +1407,135 @@ int main(int argc, char *argv[])
 		return 0;
 	}
 
-	if (sparse_open(&sparse_state, &sparse_fuse_options.options)) {
-		fprintf(stderr, "sparsebundle: %s\n", sparse_get_error(sparse_state));
+	if (sparse_fuse_options.prealloc &&
+		sparse_parse_prealloc(sparse_fuse_options.prealloc, &sparse_fuse_options.options.prealloc)) {
+		fprintf(stderr, "sparsebundle: invalid prealloc policy %s\n", sparse_fuse_options.prealloc);
+		return 1;
+	}
+
+	if (sparse_fuse_options.access &&
+		sparse_parse_access(sparse_fuse_options.access, &sparse_fuse_options.options.access)) {
+		fprintf(stderr, "sparsebundle: invalid access pattern %s\n", sparse_fuse_options.access);
+		return 1;
+	}
+
+	if (sparse_fuse_options.writeback_cache && sparse_fuse_options.passthrough) {
+		/* the kernel will not pass through files it caches writes for */
+		fprintf(stderr, "sparsebundle: --writeback-cache cannot be combined with --passthrough\n");
+		return 1;
+	}
+
+	if (sparse_fuse_options.keep_cache && sparse_fuse_options.passthrough) {
+		/* the kernel writes band files behind our back, the image could not be told */
+		fprintf(stderr, "sparsebundle: --keep-cache cannot be combined with --passthrough\n");
+		return 1;
+	}
+
+	if (sparse_fuse_options.attr_timeout < 0) {
+		fprintf(stderr, "sparsebundle: invalid attribute timeout\n");
+		return 1;
+	}
+
+	if (sparse_fuse_options.idle_timeout < 0) {
+		fprintf(stderr, "sparsebundle: invalid idle timeout\n");
+		return 1;
+	}
+
+	if (sparse_fuse_options.path_count > 0) {
+		/* hand the mountpoint back to fuse */
+		fuse_opt_add_arg(&args, sparse_fuse_options.paths[--sparse_fuse_options.path_count]);
+	}
+	if (sparse_fuse_options.directory != NULL && sparse_fuse_options.path_count > 0) {
+		fprintf(stderr, "sparsebundle: --directory cannot be combined with bundle paths\n");
+		return 1;
+	}
+	sparse_fuse_multi = sparse_fuse_options.directory != NULL || sparse_fuse_options.path_count > 1;
+	if (sparse_fuse_multi && sparse_fuse_options.passthrough) {
+		fprintf(stderr, "sparsebundle: --passthrough serves a single bundle\n");
+		return 1;
+	}
+
+	/* reads are split at max_read, writes at the negotiated max_write */
+	fuse_opt_add_arg(&args, "-omax_read=" xstr(MAX_IO_SIZE));
+	if (fuse_parse_cmdline(&args, &cmdline) != 0) {
 		return 1;
 	}
+	if (cmdline.mountpoint == NULL || (!sparse_fuse_multi && sparse_fuse_options.path_count == 0)) {
+		usage(argv[0]);
+		goto out_free;
+	}
+
+	if (sparse_fuse_add_bundles() || (!sparse_fuse_multi && sparse_fuse_open_single())) {
+		goto out_free;
+	}
+
+	if (!sparse_fuse_multi && !sparse_fuse_options.no_partitions) {
+		int n = sparse_read_partitions(sparse_fuse_bundles[0]->state, sparse_fuse_partitions, MAX_PARTITIONS);
+		if (n < 0) {
+			/* the whole disk is still there */
+			fprintf(stderr, "sparsebundle: unable to read the partition map: %s\n", strerror(-n));
+		} else {
+			sparse_fuse_partition_count = n;
+		}
+	}
 
-	return fuse_main(args.argc, args.argv, &sparse_oper, NULL);
+	se = fuse_session_new(&args, &sparse_oper, sizeof(sparse_oper), NULL);
+	if (se == NULL) {
+		goto out_close;
+	}
+	sparse_fuse_session = se;
+	if (fuse_set_signal_handlers(se) != 0) {
+		goto out_destroy;
+	}
+	if (fuse_session_mount(se, cmdline.mountpoint) != 0) {
+		goto out_signal;
+	}
+	if (!sparse_fuse_multi && !cmdline.foreground) {
+		/*
+		  library threads do not survive the fork, and joining them from the
+		  child never returns. close the bundle here and open it there.
+		*/
+		sparse_close(&sparse_fuse_bundles[0]->state);
+	}
+	fuse_daemonize(cmdline.foreground);
+	if (!sparse_fuse_multi && !cmdline.foreground && sparse_fuse_open_single()) {
+		fuse_session_unmount(se);
+		goto out_signal;
+	}
+	pthread_t reaper;
+	if (sparse_fuse_multi) {
+		/* the fd budget of --max-open-bands is shared by all bundles */
+		if (sparse_cache_create(&sparse_fuse_options.options.cache, sparse_fuse_options.options.max_open_bands)) {
+			fuse_session_unmount(se);
+			goto out_signal;
+		}
+		pthread_create(&reaper, NULL, sparse_fuse_reaper, NULL);
+	}
+	r = sparse_fuse_loop(se, &cmdline) ? 1 : 0;
+	fuse_session_unmount(se);
+	if (sparse_fuse_multi) {
+		pthread_mutex_lock(&sparse_fuse_bundle_lock);
+		sparse_fuse_reaper_stop = 1;
+		pthread_cond_signal(&sparse_fuse_reaper_wake);
+		pthread_mutex_unlock(&sparse_fuse_bundle_lock);
+		pthread_join(reaper, NULL);
+	}
+out_signal:
+	fuse_remove_signal_handlers(se);
+out_destroy:
+	sparse_fuse_session = NULL;
+	fuse_session_destroy(se);
+out_close:
+	for (int i = 0; i < sparse_fuse_bundle_count; i++) {
+		if (sparse_fuse_bundles[i]->state != NULL) {
+			sparse_close(&sparse_fuse_bundles[i]->state);
+		}
+	}
+	if (sparse_fuse_options.options.cache != NULL) {
+		sparse_cache_release(&sparse_fuse_options.options.cache);
+	}
+out_free:
+	free(cmdline.mountpoint);
+	fuse_opt_free_args(&args);
+	return r;
 }
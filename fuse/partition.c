@@ -0,0 +1,204 @@
+/*
+  sparsebundle: partition maps inside the image, for serving partitions as
+  files of their own.
+  This program can be distributed under the terms of the GNU GPLv2.
+*/
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "partition.h"
+
+#define MIN(a,b) (((a)<(b))?(a):(b))
+
+#define GPT_SIGNATURE "EFI PART"
+#define GPT_HEADER_MIN_SIZE 92
+#define GPT_ENTRY_MIN_SIZE 128
+/* way past what a real disk has, a guard against garbage */
+#define GPT_ENTRIES_MAX_SIZE (1 << 20)
+
+#define APM_DDM_SIGNATURE 0x4552
+#define APM_ENTRY_SIGNATURE 0x504d
+#define APM_ENTRY_SIZE 512
+#define APM_MAX_ENTRIES 256
+
+inline static uint16_t get_be16(const unsigned char *p)
+{
+	return (uint16_t)p[0] << 8 | p[1];
+}
+
+inline static uint32_t get_be32(const unsigned char *p)
+{
+	return (uint32_t)get_be16(p) << 16 | get_be16(p + 2);
+}
+
+inline static uint32_t get_le32(const unsigned char *p)
+{
+	return (uint32_t)p[3] << 24 | (uint32_t)p[2] << 16 | (uint32_t)p[1] << 8 | p[0];
+}
+
+inline static uint64_t get_le64(const unsigned char *p)
+{
+	return (uint64_t)get_le32(p + 4) << 32 | get_le32(p);
+}
+
+/* CRC-32 as used by GPT, bitwise, the map is read once per mount */
+static uint32_t sparse_crc32(const unsigned char *p, size_t size)
+{
+	uint32_t crc = 0xffffffff;
+	while (size--) {
+		crc ^= *p++;
+		for (int i = 0; i < 8; i++) {
+			crc = (crc >> 1) ^ (0xedb88320 & -(crc & 1));
+		}
+	}
+	return ~crc;
+}
+
+/* reads a range that must lie within the image */
+inline static int sparse_read_exact(sparse_handle_t state, void *buf, size_t size, off_t offset)
+{
+	if (offset < 0 || offset + (off_t)size > (off_t)sparse_get_size(state)) {
+		return -EINVAL;
+	}
+	int r = sparse_pread(state, buf, size, offset);
+	return r < 0 ? r : (size_t)r < size ? -EIO : 0;
+}
+
+/* keeps partitions that start within the image, cut at its end */
+static int sparse_add_partition(struct sparse_partition *partitions, int n, int count, int number, off_t offset, off_t length, off_t size)
+{
+	if (n >= count || offset < 0 || offset >= size || length <= 0) {
+		return n;
+	}
+	partitions[n].number = number;
+	partitions[n].offset = offset;
+	partitions[n].length = MIN(length, size - offset);
+	return n + 1;
+}
+
+static int sparse_read_gpt(sparse_handle_t state, struct sparse_partition *partitions, int count, uint32_t sector_size)
+{
+	unsigned char header[512];
+	off_t size = sparse_get_size(state);
+	uint64_t sectors = size / sector_size;
+	int n = 0, r;
+	if (sectors < 2) {
+		return 0;
+	}
+	r = sparse_read_exact(state, header, sizeof(header), sector_size);
+	if (r < 0) {
+		return r;
+	}
+	uint32_t header_size = get_le32(header + 12);
+	if (memcmp(header, GPT_SIGNATURE, 8) != 0 || get_le64(header + 24) != 1 ||
+		header_size < GPT_HEADER_MIN_SIZE || header_size > sizeof(header)) {
+		return 0;
+	}
+	uint32_t header_crc = get_le32(header + 16);
+	memset(header + 16, 0, 4);
+	if (sparse_crc32(header, header_size) != header_crc) {
+		return 0;
+	}
+
+	uint64_t entries_lba = get_le64(header + 72);
+	uint32_t entries = get_le32(header + 80);
+	uint32_t entry_size = get_le32(header + 84);
+	uint64_t entries_size = (uint64_t)entries * entry_size;
+	if (entry_size < GPT_ENTRY_MIN_SIZE || entries_size > GPT_ENTRIES_MAX_SIZE ||
+		entries_lba >= sectors || entries_size > (uint64_t)size - entries_lba * sector_size) {
+		return 0;
+	}
+	unsigned char *table = malloc(entries_size);
+	r = sparse_read_exact(state, table, entries_size, entries_lba * sector_size);
+	if (r < 0 || sparse_crc32(table, entries_size) != get_le32(header + 88)) {
+		free(table);
+		return r < 0 ? r : 0;
+	}
+	static const unsigned char unused[16] = {0};
+	for (uint32_t i = 0; i < entries; i++) {
+		const unsigned char *entry = table + (size_t)i * entry_size;
+		uint64_t first = get_le64(entry + 32);
+		uint64_t last = get_le64(entry + 40);
+		if (memcmp(entry, unused, sizeof(unused)) == 0 || last < first || first >= sectors) {
+			continue;
+		}
+		/* last is inclusive */
+		uint64_t end = last >= sectors ? sectors : last + 1;
+		n = sparse_add_partition(partitions, n, count, i + 1,
+			first * sector_size, (end - first) * sector_size, size);
+	}
+	free(table);
+	return n;
+}
+
+static int sparse_read_apm(sparse_handle_t state, struct sparse_partition *partitions, int count)
+{
+	unsigned char block[APM_ENTRY_SIZE];
+	off_t size = sparse_get_size(state);
+	uint32_t block_size = APM_ENTRY_SIZE;
+	int n = 0, r;
+	if (size < 2 * APM_ENTRY_SIZE) {
+		return 0;
+	}
+	/* the driver descriptor has the block size, CDs use 2048 */
+	r = sparse_read_exact(state, block, sizeof(block), 0);
+	if (r < 0) {
+		return r;
+	}
+	if (get_be16(block) == APM_DDM_SIGNATURE) {
+		uint32_t ddm_block_size = get_be16(block + 2);
+		if (ddm_block_size >= APM_ENTRY_SIZE && ddm_block_size <= 4096 &&
+			(ddm_block_size & (ddm_block_size - 1)) == 0) {
+			block_size = ddm_block_size;
+		}
+	}
+	/* entry 1 is the map itself, and knows how many there are */
+	uint32_t entries = 1;
+	for (uint32_t i = 1; i <= entries; i++) {
+		if ((off_t)i * block_size + APM_ENTRY_SIZE > size) {
+			break;
+		}
+		r = sparse_read_exact(state, block, sizeof(block), (off_t)i * block_size);
+		if (r < 0) {
+			return r;
+		}
+		if (get_be16(block) != APM_ENTRY_SIGNATURE) {
+			break;
+		}
+		if (i == 1) {
+			entries = MIN(get_be32(block + 4), APM_MAX_ENTRIES);
+		}
+		if (strncmp((const char *)block + 48, "Apple_Free", 32) == 0) {
+			continue;
+		}
+		n = sparse_add_partition(partitions, n, count, i,
+			(off_t)get_be32(block + 8) * block_size, (off_t)get_be32(block + 12) * block_size, size);
+	}
+	return n;
+}
+
+int sparse_read_partitions(sparse_handle_t state, struct sparse_partition *partitions, int count)
+{
+	/* GPT is found at LBA 1, which depends on the logical sector size */
+	static const uint32_t sector_sizes[] = { 512, 4096 };
+	int r = 0, n;
+	for (size_t i = 0; i < sizeof(sector_sizes) / sizeof(sector_sizes[0]); i++) {
+		n = sparse_read_gpt(state, partitions, count, sector_sizes[i]);
+		if (n > 0) {
+			return n;
+		}
+		/* a probe that cannot read what it looks for found no map, try the next */
+		r = r < 0 || n == -EINVAL ? r : n;
+	}
+	n = sparse_read_apm(state, partitions, count);
+	if (n > 0) {
+		return n;
+	}
+	/* an error is only reported when no format was found */
+	return r < 0 || n == -EINVAL ? r : n;
+}
@@ -0,0 +1,28 @@
+/*
+  sparsebundle: partition maps inside the image, for serving partitions as
+  files of their own.
+  This program can be distributed under the terms of the GNU GPLv2.
+*/
+
+#ifndef SPARSE_PARTITION_H
+#define SPARSE_PARTITION_H
+
+#include <sys/types.h>
+
+#include "sparsebundle.h"
+
+struct sparse_partition {
+	/* as numbered by the map, starting at 1 */
+	int number;
+	off_t offset;
+	off_t length;
+};
+
+/*
+  reads the GPT or, failing that, the Apple partition map at the start of
+  the image. returns the number of partitions stored, at most count, 0 when
+  there is no map, or a negative errno.
+*/
+int sparse_read_partitions(sparse_handle_t state, struct sparse_partition *partitions, int count);
+
+#endif
@@ -3,21 +3,220 @@
 
 #include <stdio.h>
 #include <stddef.h>
+#include <stdint.h>
+
+/* how band files are preallocated when they are created */
+enum sparse_prealloc {
+	/* grow one write at a time */
+	SPARSE_PREALLOC_NONE = 0,
+	/* allocate the whole band */
+	SPARSE_PREALLOC_FULL,
+	/* allocate ahead of writes in chunks, without changing the file size */
+	SPARSE_PREALLOC_KEEP_SIZE,
+	/* extend the file to the band size, leaving it sparse */
+	SPARSE_PREALLOC_TRUNCATE,
+};
+
+/* expected access pattern, used for madvise hints on mapped bands */
+enum sparse_access {
+	SPARSE_ACCESS_NORMAL = 0,
+	SPARSE_ACCESS_SEQUENTIAL,
+	SPARSE_ACCESS_RANDOM,
+};
+
+struct sparse_state;
+typedef struct sparse_state *sparse_handle_t;
+
+struct sparse_cache;
+typedef struct sparse_cache *sparse_cache_t;
 
 struct sparse_options {
 	const char *path;
+	/* bands in use by requests in flight are never closed, they may run over it */
 	int max_open_bands;
+	/* band cache shared with other bundles, NULL for a private one of max_open_bands */
+	sparse_cache_t cache;
+	enum sparse_prealloc prealloc;
+	/* open bands O_RDONLY, writes and trims fail with EROFS */
+	int read_only;
+	/*
+	  serve band I/O from MAP_SHARED mappings instead of pread/pwrite.
+	  while such a bundle is open the library handles SIGBUS process-wide,
+	  faults outside its own copies go on to the handler it replaced.
+	*/
+	int mmap_bands;
+	enum sparse_access access;
+	/* open bands O_DIRECT, misaligned requests go through bounce buffers */
+	int direct_io;
+	/* worker threads serving sparse_submit, 0 to complete requests in the caller */
+	int async_threads;
+	/* called after sparse_resize changed the size, NULL if not wanted */
+	void (*resized)(sparse_handle_t state, size_t old_size, size_t size);
 };
 
-struct sparse_state;
-typedef struct sparse_state *sparse_handle_t;
+
+/* extent flags: unallocated, reads back as zeros */
+#define SPARSE_EXTENT_HOLE 1
+
+/* zero flags: zeroed ranges may be deallocated */
+#define SPARSE_ZERO_MAY_TRIM 1
+/* zero flags: fail with ENOTSUP rather than writing zeros out */
+#define SPARSE_ZERO_FAST 2
+/* zero flags: punch holes instead of removing whole band files */
+#define SPARSE_ZERO_KEEP_BANDS 4
+
+/* called for consecutive extents, return non zero to stop */
+typedef int (*sparse_extent_fn)(void *opaque, off_t offset, size_t length, int flags);
+
+enum sparse_op {
+	SPARSE_OP_READ = 0,
+	SPARSE_OP_WRITE,
+	SPARSE_OP_FLUSH,
+	SPARSE_OP_TRIM,
+	SPARSE_OP_ZERO,
+	SPARSE_OP_CACHE,
+	SPARSE_OP_EXTENTS,
+};
+
+/* an operation for sparse_submit, owned by the caller until complete is called */
+struct sparse_request {
+	enum sparse_op op;
+	char *buf;
+	size_t size;
+	off_t offset;
+	/* SPARSE_OP_ZERO: SPARSE_ZERO_* flags */
+	int flags;
+	/* flush after the operation, before completing */
+	int fua;
+	/* SPARSE_OP_EXTENTS: called with opaque */
+	sparse_extent_fn extent;
+	/* result of the matching synchronous call, or negative errno */
+	int result;
+	/* called once on a worker thread, the request may be freed from here */
+	void (*complete)(struct sparse_request *request);
+	void *opaque;
+	/* internal */
+	struct sparse_request *next;
+};
+
+/* a run of the image backed by a band file, or zeros when fd is negative */
+struct sparse_segment {
+	int fd;
+	off_t offset;
+	size_t size;
+	/* internal */
+	void *band;
+	int write;
+};
+
+/* counters of struct sparse_stats, as X(name, description) */
+#define SPARSE_STATS(X) \
+	X(reads, "read requests") \
+	X(writes, "write requests") \
+	X(syncs, "flush and sync requests") \
+	X(trims, "trim requests") \
+	X(zeros, "zero requests") \
+	X(prefetches, "prefetch requests") \
+	X(extents, "extent queries") \
+	X(bytes_read, "bytes read") \
+	X(bytes_written, "bytes written") \
+	X(bytes_read_holes, "bytes read as zeros, from holes or past the end of band files") \
+	X(bytes_trimmed, "bytes trimmed") \
+	X(bytes_zeroed, "bytes zeroed") \
+	X(cache_hits, "band lookups served from the band cache") \
+	X(cache_misses, "band lookups that opened the band") \
+	X(cache_evictions, "bands closed to make room in the band cache") \
+	X(band_opens, "band file open calls") \
+	X(band_opens_missing, "band file opens that found no file") \
+	X(band_creates, "band files created") \
+	X(band_unlinks, "band files removed") \
+	X(band_syncs, "band file syncs") \
+	X(short_reads, "band reads cut short by the end of the file")
+
+/* since the bundle was opened */
+struct sparse_stats {
+#define SPARSE_STATS_FIELD(name, description) uint64_t name;
+	SPARSE_STATS(SPARSE_STATS_FIELD)
+#undef SPARSE_STATS_FIELD
+};
+
+/* histograms of struct sparse_latencies, as X(name, description) */
+#define SPARSE_LATENCIES(X) \
+	X(pread, "sparse_pread calls") \
+	X(pwrite, "sparse_pwrite calls") \
+	X(flush, "sparse_flush and sparse_sync calls") \
+	X(trim, "sparse_trim calls") \
+	X(sys_open, "band file opens") \
+	X(sys_pread, "band file preads") \
+	X(sys_pwrite, "band file pwrites") \
+	X(sys_fsync, "band file and bands directory syncs") \
+	X(sys_unlink, "band file unlinks")
+
+/*
+  4 buckets per power of two, from 4ns up to 2^40ns (about 18 minutes),
+  below 4ns one per nanosecond. the last bucket takes anything longer.
+*/
+#define SPARSE_HISTOGRAM_BUCKETS 156
+
+/* latencies in nanoseconds */
+struct sparse_histogram {
+	uint64_t count;
+	uint64_t sum;
+	uint64_t buckets[SPARSE_HISTOGRAM_BUCKETS];
+};
+
+/* since the bundle was opened */
+struct sparse_latencies {
+#define SPARSE_LATENCIES_FIELD(name, description) struct sparse_histogram name;
+	SPARSE_LATENCIES(SPARSE_LATENCIES_FIELD)
+#undef SPARSE_LATENCIES_FIELD
+};
+
+/* space taken by the band files, kept up to date without listing them */
+struct sparse_usage {
+	/* bytes allocated on disk */
+	uint64_t allocated;
+	/* band files */
+	uint64_t bands;
+};
 
 int sparse_pread(sparse_handle_t state, char *buf, size_t size, off_t offset);
 int sparse_pwrite(sparse_handle_t state, const char *buf, size_t size, off_t offset);
 int sparse_flush(sparse_handle_t state);
+int sparse_sync(sparse_handle_t state, int datasync);
 int sparse_trim(struct sparse_state *state, size_t size, off_t offset);
+int sparse_zero(sparse_handle_t state, size_t size, off_t offset, int flags);
+int sparse_prefetch(sparse_handle_t state, size_t size, off_t offset);
+int sparse_submit(sparse_handle_t state, struct sparse_request *request);
+int sparse_get_segments(sparse_handle_t state, size_t size, off_t offset, int write, struct sparse_segment *segments, int count);
+void sparse_put_segments(sparse_handle_t state, struct sparse_segment *segments, int count);
+int sparse_open_band_file(sparse_handle_t state, int id, int write);
+int sparse_resize(sparse_handle_t state, size_t size);
+int sparse_extents(sparse_handle_t state, size_t size, off_t offset, sparse_extent_fn fn, void *opaque);
+
+int sparse_parse_prealloc(const char *name, enum sparse_prealloc *prealloc);
+int sparse_parse_access(const char *name, enum sparse_access *access);
 
+int sparse_cache_create(sparse_cache_t *cache, int max_open_bands);
+void sparse_cache_release(sparse_cache_t *cache);
 size_t sparse_get_size(sparse_handle_t state);
+size_t sparse_get_band_size(sparse_handle_t state);
+/* image size from the Info.plist of a bundle that is not open, 0 or a negative errno */
+int sparse_read_size(const char *path, uint64_t *size);
+int sparse_get_usage(sparse_handle_t state, struct sparse_usage *usage);
+int sparse_get_stats(sparse_handle_t state, struct sparse_stats *stats);
+int sparse_get_latencies(sparse_handle_t state, struct sparse_latencies *latencies);
+/* the smallest latency counted in a bucket, in nanoseconds */
+uint64_t sparse_histogram_bucket_min(int bucket);
+/* writes the counters and the non empty histogram buckets as a JSON object */
+int sparse_dump_stats(sparse_handle_t state, FILE *f);
+/*
+  writes the counters, usage and histograms of several bundles in the
+  prometheus text format, each labelled bundle="names[i]". names may be
+  NULL to leave the samples unlabelled, for a single bundle.
+*/
+int sparse_dump_prometheus(FILE *f, sparse_handle_t *states, const char **names, int count);
+/* NULL for why the last sparse_open on this thread failed */
 const char *sparse_get_error(sparse_handle_t state);
 int sparse_open(sparse_handle_t *state_ptr, const struct sparse_options *options);
 int sparse_close(sparse_handle_t *state_ptr);
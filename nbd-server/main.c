@@ -0,0 +1,1072 @@
+/*
+  sparsebundle: read-write, sparsebundle compatible fuse fs.
+  Yifan Gu <me@yifangu.com>
+  This program can be distributed under the terms of the GNU GPLv2.
+*/
+
+#define _POSIX_C_SOURCE 200809L
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include "sparsebundle.h"
+#include "protocol.h"
+
+#define xstr(s) str(s)
+#define str(s) #s
+
+#define DEFAULT_MAX_OPEN_BANDS 16
+#define DEFAULT_THREADS 4
+#define DEFAULT_PORT 10809
+/* largest read or write request */
+#define MAX_PAYLOAD (32 << 20)
+/* largest option a client may send during the handshake */
+#define MAX_OPTION (64 << 10)
+/* requests in flight per connection before it stops being read */
+#define MAX_INFLIGHT 64
+/* requests taken from one connection per wakeup, for fairness */
+#define RECEIVE_BATCH 16
+/* block status descriptors in one reply */
+#define MAX_EXTENTS 1024
+/* room in front of read data for the reply header */
+#define REPLY_HEADROOM 32
+#define META_ALLOCATION_ID 1
+#define META_ALLOCATION "base:allocation"
+
+struct nbd_conn {
+	int fd;
+	/* the event loop and every request in flight hold a reference */
+	int refs;
+	int structured;
+	/* base:allocation negotiated */
+	int meta_allocation;
+	/* no longer read, the event loop keeps it until its replies are out */
+	int dropped;
+	/* replies the socket had no room for, in order, protected by send_lock */
+	struct nbd_request *replies;
+	struct nbd_request **replies_tail;
+	/* a send failed, replies are dropped from now on, protected by send_lock */
+	int failed;
+	pthread_mutex_t send_lock;
+	/* request header being received */
+	unsigned char header[NBD_REQUEST_SIZE];
+	size_t header_length;
+	/* write request whose payload is being received */
+	struct nbd_request *receiving;
+	size_t payload_length;
+	struct nbd_conn *next;
+};
+
+struct nbd_request {
+	struct sparse_request request;
+	struct nbd_conn *conn;
+	uint64_t cookie;
+	uint16_t type;
+	uint16_t flags;
+	uint64_t offset;
+	uint32_t length;
+	/* read or write data, after REPLY_HEADROOM bytes for the header */
+	unsigned char *reply;
+	/* block status descriptors, length and flags pairs */
+	uint32_t *extents;
+	int extent_count;
+	/* the reply, header then payload, and how much of it went out */
+	unsigned char header[NBD_STRUCTURED_REPLY_SIZE + 12];
+	size_t header_length;
+	const unsigned char *payload;
+	size_t payload_length;
+	size_t sent;
+	struct nbd_request *next;
+};
+
+static struct nbd_server {
+	const char *socket_path;
+	int port;
+	int threads;
+	char *export_name;
+	char *prealloc;
+	char *access;
+	int show_help;
+	struct sparse_options options;
+	sparse_handle_t state;
+	/* self pipe waking the event loop */
+	int wake[2];
+	volatile sig_atomic_t stop;
+	/* connections done with the handshake, protected by lock */
+	struct nbd_conn *pending;
+	pthread_mutex_t lock;
+} server = {
+	.port = DEFAULT_PORT,
+	.threads = DEFAULT_THREADS,
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static unsigned char *nbd_put16(unsigned char *p, uint16_t v)
+{
+	p[0] = v >> 8;
+	p[1] = v;
+	return p + 2;
+}
+
+static unsigned char *nbd_put32(unsigned char *p, uint32_t v)
+{
+	return nbd_put16(nbd_put16(p, v >> 16), v);
+}
+
+static unsigned char *nbd_put64(unsigned char *p, uint64_t v)
+{
+	return nbd_put32(nbd_put32(p, v >> 32), v);
+}
+
+static uint16_t nbd_get16(const unsigned char *p)
+{
+	return (uint16_t) p[0] << 8 | p[1];
+}
+
+static uint32_t nbd_get32(const unsigned char *p)
+{
+	return (uint32_t) nbd_get16(p) << 16 | nbd_get16(p + 2);
+}
+
+static uint64_t nbd_get64(const unsigned char *p)
+{
+	return (uint64_t) nbd_get32(p) << 32 | nbd_get32(p + 4);
+}
+
+static void nbd_wake()
+{
+	ssize_t r = write(server.wake[1], "", 1);
+	(void) r;
+}
+
+/* sends all of buf, handshake only, the socket is still blocking then */
+static int nbd_send(int fd, const void *buf, size_t length)
+{
+	const char *p = buf;
+	while (length > 0) {
+		ssize_t n = write(fd, p, length);
+		if (n < 0) {
+			if (errno != EINTR) {
+				return -1;
+			}
+			continue;
+		}
+		p += n;
+		length -= n;
+	}
+	return 0;
+}
+
+/* blocking receive, handshake only */
+static int nbd_recv(int fd, void *buf, size_t length)
+{
+	char *p = buf;
+	while (length > 0) {
+		ssize_t n = read(fd, p, length);
+		if (n == 0 || (n < 0 && errno != EINTR)) {
+			return -1;
+		}
+		if (n > 0) {
+			p += n;
+			length -= n;
+		}
+	}
+	return 0;
+}
+
+static void nbd_conn_put(struct nbd_conn *conn)
+{
+	int refs = __atomic_sub_fetch(&conn->refs, 1, __ATOMIC_SEQ_CST);
+	if (refs == 0) {
+		close(conn->fd);
+		pthread_mutex_destroy(&conn->send_lock);
+		free(conn);
+	} else if (refs == MAX_INFLIGHT) {
+		/* back below the limit, the loop can read it again */
+		nbd_wake();
+	} else if (refs == 1 && __atomic_load_n(&conn->dropped, __ATOMIC_SEQ_CST)) {
+		/* the last request of a dropped connection, the loop can let it go */
+		nbd_wake();
+	}
+}
+
+static uint16_t nbd_transmission_flags()
+{
+	uint16_t flags = NBD_FLAG_HAS_FLAGS | NBD_FLAG_SEND_FLUSH | NBD_FLAG_SEND_DF |
+		NBD_FLAG_CAN_MULTI_CONN | NBD_FLAG_SEND_CACHE;
+	if (server.options.read_only) {
+		flags |= NBD_FLAG_READ_ONLY;
+	} else {
+		flags |= NBD_FLAG_SEND_FUA | NBD_FLAG_SEND_TRIM |
+			NBD_FLAG_SEND_WRITE_ZEROES | NBD_FLAG_SEND_FAST_ZERO;
+	}
+	return flags;
+}
+
+static int nbd_option_reply(int fd, uint32_t option, uint32_t type, const void *data, uint32_t length)
+{
+	unsigned char header[20], *p = header;
+	p = nbd_put64(p, NBD_REP_MAGIC);
+	p = nbd_put32(p, option);
+	p = nbd_put32(p, type);
+	nbd_put32(p, length);
+	if (nbd_send(fd, header, sizeof(header)) || nbd_send(fd, data, length)) {
+		return -1;
+	}
+	return 0;
+}
+
+/* NBD_OPT_INFO and NBD_OPT_GO, any export name is this bundle */
+static int nbd_option_info(struct nbd_conn *conn, uint32_t option, const unsigned char *data, uint32_t length)
+{
+	unsigned char info[14], *p;
+	if (length < 6 || nbd_get32(data) > length - 6) {
+		return nbd_option_reply(conn->fd, option, NBD_REP_ERR_INVALID, NULL, 0);
+	}
+	uint32_t name_length = nbd_get32(data);
+	uint16_t requests = nbd_get16(data + 4 + name_length);
+	if (length != 6 + name_length + 2 * (uint32_t) requests) {
+		return nbd_option_reply(conn->fd, option, NBD_REP_ERR_INVALID, NULL, 0);
+	}
+	p = nbd_put16(info, NBD_INFO_EXPORT);
+	p = nbd_put64(p, sparse_get_size(server.state));
+	nbd_put16(p, nbd_transmission_flags());
+	if (nbd_option_reply(conn->fd, option, NBD_REP_INFO, info, 12)) {
+		return -1;
+	}
+	for (int i = 0; i < requests; i++) {
+		if (nbd_get16(data + 6 + name_length + 2 * i) == NBD_INFO_BLOCK_SIZE) {
+			p = nbd_put16(info, NBD_INFO_BLOCK_SIZE);
+			p = nbd_put32(p, 1);
+			p = nbd_put32(p, 4096);
+			nbd_put32(p, MAX_PAYLOAD);
+			if (nbd_option_reply(conn->fd, option, NBD_REP_INFO, info, 14)) {
+				return -1;
+			}
+		}
+	}
+	return nbd_option_reply(conn->fd, option, NBD_REP_ACK, NULL, 0);
+}
+
+/* NBD_OPT_LIST_META_CONTEXT and NBD_OPT_SET_META_CONTEXT, only base:allocation exists */
+static int nbd_option_meta(struct nbd_conn *conn, uint32_t option, const unsigned char *data, uint32_t length)
+{
+	int list = option == NBD_OPT_LIST_META_CONTEXT;
+	if (!list && !conn->structured) {
+		return nbd_option_reply(conn->fd, option, NBD_REP_ERR_INVALID, NULL, 0);
+	}
+	if (length < 8 || nbd_get32(data) > length - 8) {
+		return nbd_option_reply(conn->fd, option, NBD_REP_ERR_INVALID, NULL, 0);
+	}
+	uint32_t position = 4 + nbd_get32(data);
+	uint32_t queries = nbd_get32(data + position);
+	int match = list && queries == 0;
+	position += 4;
+	for (uint32_t i = 0; i < queries; i++) {
+		if (length - position < 4 || nbd_get32(data + position) > length - position - 4) {
+			return nbd_option_reply(conn->fd, option, NBD_REP_ERR_INVALID, NULL, 0);
+		}
+		uint32_t query_length = nbd_get32(data + position);
+		const char *query = (const char *) data + position + 4;
+		if ((query_length == strlen(META_ALLOCATION) && memcmp(query, META_ALLOCATION, query_length) == 0) ||
+			(list && query_length == strlen("base:") && memcmp(query, "base:", query_length) == 0)) {
+			match = 1;
+		}
+		position += 4 + query_length;
+	}
+	if (!list) {
+		conn->meta_allocation = match;
+	}
+	if (match) {
+		unsigned char context[4 + sizeof(META_ALLOCATION) - 1];
+		nbd_put32(context, META_ALLOCATION_ID);
+		memcpy(context + 4, META_ALLOCATION, sizeof(META_ALLOCATION) - 1);
+		if (nbd_option_reply(conn->fd, option, NBD_REP_META_CONTEXT, context, sizeof(context))) {
+			return -1;
+		}
+	}
+	return nbd_option_reply(conn->fd, option, NBD_REP_ACK, NULL, 0);
+}
+
+/* fixed newstyle negotiation, 0 once the connection enters transmission */
+static int nbd_handshake(struct nbd_conn *conn)
+{
+	unsigned char buf[134] = {0}, *p;
+	p = nbd_put64(buf, NBD_MAGIC);
+	p = nbd_put64(p, NBD_IHAVEOPT);
+	nbd_put16(p, NBD_FLAG_FIXED_NEWSTYLE | NBD_FLAG_NO_ZEROES);
+	if (nbd_send(conn->fd, buf, 18) || nbd_recv(conn->fd, buf, 4)) {
+		return -1;
+	}
+	uint32_t client_flags = nbd_get32(buf);
+	if (!(client_flags & NBD_FLAG_C_FIXED_NEWSTYLE)) {
+		return -1;
+	}
+	while (1) {
+		if (nbd_recv(conn->fd, buf, 16) || nbd_get64(buf) != NBD_IHAVEOPT) {
+			return -1;
+		}
+		uint32_t option = nbd_get32(buf + 8);
+		uint32_t length = nbd_get32(buf + 12);
+		if (length > MAX_OPTION) {
+			return -1;
+		}
+		unsigned char *data = malloc(length);
+		if (nbd_recv(conn->fd, data, length)) {
+			free(data);
+			return -1;
+		}
+		int r = 0;
+		switch (option) {
+			case NBD_OPT_EXPORT_NAME:
+				/* no way to refuse, transmission starts right away */
+				free(data);
+				memset(buf, 0, sizeof(buf));
+				p = nbd_put64(buf, sparse_get_size(server.state));
+				nbd_put16(p, nbd_transmission_flags());
+				return nbd_send(conn->fd, buf, client_flags & NBD_FLAG_C_NO_ZEROES ? 10 : 134);
+			case NBD_OPT_ABORT:
+				nbd_option_reply(conn->fd, option, NBD_REP_ACK, NULL, 0);
+				free(data);
+				return -1;
+			case NBD_OPT_LIST:
+				if (length != 0) {
+					r = nbd_option_reply(conn->fd, option, NBD_REP_ERR_INVALID, NULL, 0);
+					break;
+				} else {
+					size_t name_length = strlen(server.export_name);
+					unsigned char *entry = malloc(4 + name_length);
+					nbd_put32(entry, name_length);
+					memcpy(entry + 4, server.export_name, name_length);
+					r = nbd_option_reply(conn->fd, option, NBD_REP_SERVER, entry, 4 + name_length);
+					free(entry);
+				}
+				r = r ? r : nbd_option_reply(conn->fd, option, NBD_REP_ACK, NULL, 0);
+				break;
+			case NBD_OPT_STRUCTURED_REPLY:
+				if (length != 0) {
+					r = nbd_option_reply(conn->fd, option, NBD_REP_ERR_INVALID, NULL, 0);
+					break;
+				}
+				conn->structured = 1;
+				r = nbd_option_reply(conn->fd, option, NBD_REP_ACK, NULL, 0);
+				break;
+			case NBD_OPT_INFO:
+			case NBD_OPT_GO:
+				r = nbd_option_info(conn, option, data, length);
+				if (r == 0 && option == NBD_OPT_GO) {
+					free(data);
+					return 0;
+				}
+				break;
+			case NBD_OPT_LIST_META_CONTEXT:
+			case NBD_OPT_SET_META_CONTEXT:
+				r = nbd_option_meta(conn, option, data, length);
+				break;
+			default:
+				r = nbd_option_reply(conn->fd, option, NBD_REP_ERR_UNSUP, NULL, 0);
+				break;
+		}
+		free(data);
+		if (r) {
+			return -1;
+		}
+	}
+}
+
+static void *nbd_handshake_thread(void *arg)
+{
+	struct nbd_conn *conn = arg;
+	if (nbd_handshake(conn)) {
+		nbd_conn_put(conn);
+		return NULL;
+	}
+	/* neither the event loop nor the workers ever wait on the socket */
+	fcntl(conn->fd, F_SETFL, fcntl(conn->fd, F_GETFL) | O_NONBLOCK);
+	pthread_mutex_lock(&server.lock);
+	conn->next = server.pending;
+	server.pending = conn;
+	pthread_mutex_unlock(&server.lock);
+	nbd_wake();
+	return NULL;
+}
+
+static uint32_t nbd_errno(int error)
+{
+	switch (error) {
+		case 0:
+			return 0;
+		case EPERM:
+		case EROFS:
+			return NBD_EPERM;
+		case ENOMEM:
+			return NBD_ENOMEM;
+		case EINVAL:
+			return NBD_EINVAL;
+		case ENOSPC:
+		case EFBIG:
+#ifdef EDQUOT
+		case EDQUOT:
+#endif
+			return NBD_ENOSPC;
+		case EOVERFLOW:
+			return NBD_EOVERFLOW;
+		case ENOTSUP:
+#if EOPNOTSUPP != ENOTSUP
+		case EOPNOTSUPP:
+#endif
+			return NBD_ENOTSUP;
+		case ESHUTDOWN:
+			return NBD_ESHUTDOWN;
+		default:
+			return NBD_EIO;
+	}
+}
+
+static void nbd_request_free(struct nbd_request *req)
+{
+	free(req->reply);
+	free(req->extents);
+	free(req);
+}
+
+/* frees requests whose replies are done with, and their references */
+static void nbd_requests_free(struct nbd_request *done)
+{
+	while (done != NULL) {
+		struct nbd_request *req = done;
+		struct nbd_conn *conn = req->conn;
+		done = req->next;
+		nbd_request_free(req);
+		nbd_conn_put(conn);
+	}
+}
+
+/*
+  writes queued replies until the socket is full, moving those sent or
+  dropped to done. locking conn->send_lock required
+*/
+static void nbd_flush(struct nbd_conn *conn, struct nbd_request **done)
+{
+	while (conn->replies != NULL) {
+		struct nbd_request *req = conn->replies;
+		struct iovec iov[2];
+		int count = 0;
+		if (!conn->failed) {
+			size_t sent = req->sent;
+			if (sent < req->header_length) {
+				iov[count].iov_base = req->header + sent;
+				iov[count++].iov_len = req->header_length - sent;
+				sent = 0;
+			} else {
+				sent -= req->header_length;
+			}
+			if (sent < req->payload_length) {
+				iov[count].iov_base = (void *) (req->payload + sent);
+				iov[count++].iov_len = req->payload_length - sent;
+			}
+		}
+		if (count > 0) {
+			ssize_t n = writev(conn->fd, iov, count);
+			if (n < 0 && errno == EINTR) {
+				continue;
+			}
+			if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+				/* the event loop goes on once there is room */
+				return;
+			}
+			if (n < 0) {
+				/* the event loop sees the connection go */
+				conn->failed = 1;
+				shutdown(conn->fd, SHUT_RDWR);
+				continue;
+			}
+			req->sent += n;
+			if (req->sent < req->header_length + req->payload_length) {
+				continue;
+			}
+		}
+		conn->replies = req->next;
+		if (conn->replies == NULL) {
+			conn->replies_tail = &conn->replies;
+		}
+		req->next = *done;
+		*done = req;
+	}
+}
+
+/*
+  queues the reply behind those of other requests and sends what the
+  socket takes without waiting, error is an errno. the request is freed
+  once its reply is out.
+*/
+static void nbd_reply(struct nbd_request *req, int error)
+{
+	struct nbd_conn *conn = req->conn;
+	struct nbd_request *done = NULL;
+	unsigned char *header = req->header, *p;
+	const unsigned char *payload = NULL;
+	size_t header_length, payload_length = 0;
+	uint32_t nbd_error = nbd_errno(error);
+	if (!conn->structured) {
+		p = nbd_put32(header, NBD_SIMPLE_REPLY_MAGIC);
+		p = nbd_put32(p, nbd_error);
+		nbd_put64(p, req->cookie);
+		header_length = NBD_SIMPLE_REPLY_SIZE;
+		if (req->type == NBD_CMD_READ && nbd_error == 0) {
+			payload = req->reply + REPLY_HEADROOM;
+			payload_length = req->length;
+		}
+	} else {
+		p = nbd_put32(header, NBD_STRUCTURED_REPLY_MAGIC);
+		p = nbd_put16(p, NBD_REPLY_FLAG_DONE);
+		if (nbd_error) {
+			p = nbd_put16(p, NBD_REPLY_TYPE_ERROR);
+			p = nbd_put64(p, req->cookie);
+			p = nbd_put32(p, 6);
+			p = nbd_put32(p, nbd_error);
+			nbd_put16(p, 0);
+			header_length = NBD_STRUCTURED_REPLY_SIZE + 6;
+		} else if (req->type == NBD_CMD_READ) {
+			p = nbd_put16(p, NBD_REPLY_TYPE_OFFSET_DATA);
+			p = nbd_put64(p, req->cookie);
+			p = nbd_put32(p, 8 + req->length);
+			nbd_put64(p, req->offset);
+			header_length = NBD_STRUCTURED_REPLY_SIZE + 8;
+			payload = req->reply + REPLY_HEADROOM;
+			payload_length = req->length;
+		} else if (req->type == NBD_CMD_BLOCK_STATUS) {
+			p = nbd_put16(p, NBD_REPLY_TYPE_BLOCK_STATUS);
+			p = nbd_put64(p, req->cookie);
+			p = nbd_put32(p, 4 + 8 * req->extent_count);
+			nbd_put32(p, META_ALLOCATION_ID);
+			header_length = NBD_STRUCTURED_REPLY_SIZE + 4;
+			payload = (const unsigned char *) req->extents;
+			payload_length = 8 * req->extent_count;
+		} else {
+			p = nbd_put16(p, NBD_REPLY_TYPE_NONE);
+			p = nbd_put64(p, req->cookie);
+			nbd_put32(p, 0);
+			header_length = NBD_STRUCTURED_REPLY_SIZE;
+		}
+	}
+	if (payload != NULL && payload == req->reply + REPLY_HEADROOM) {
+		/* one buffer for header and data */
+		memcpy(req->reply + REPLY_HEADROOM - header_length, header, header_length);
+		payload -= header_length;
+		payload_length += header_length;
+		header_length = 0;
+	}
+	req->header_length = header_length;
+	req->payload = payload;
+	req->payload_length = payload_length;
+	req->next = NULL;
+	pthread_mutex_lock(&conn->send_lock);
+	*conn->replies_tail = req;
+	conn->replies_tail = &req->next;
+	nbd_flush(conn, &done);
+	int queued = conn->replies != NULL;
+	pthread_mutex_unlock(&conn->send_lock);
+	if (queued) {
+		/* a slow client, the event loop sends the rest */
+		nbd_wake();
+	}
+	nbd_requests_free(done);
+}
+
+static void nbd_complete(struct sparse_request *request)
+{
+	struct nbd_request *req = request->opaque;
+	nbd_reply(req, request->result < 0 ? -request->result : 0);
+}
+
+static int nbd_add_extent(void *opaque, off_t offset, size_t length, int flags)
+{
+	struct nbd_request *req = opaque;
+	uint32_t state = flags & SPARSE_EXTENT_HOLE ? NBD_STATE_HOLE | NBD_STATE_ZERO : 0;
+	if (req->extents == NULL) {
+		req->extents = malloc(MAX_EXTENTS * 8);
+	}
+	nbd_put32((unsigned char *) &req->extents[2 * req->extent_count], length);
+	nbd_put32((unsigned char *) &req->extents[2 * req->extent_count + 1], state);
+	req->extent_count++;
+	return req->extent_count == MAX_EXTENTS || (req->flags & NBD_CMD_FLAG_REQ_ONE);
+}
+
+/* hands a received request to the library, negative to drop the connection */
+static int nbd_dispatch(struct nbd_conn *conn, struct nbd_request *req)
+{
+	struct sparse_request *request = &req->request;
+	uint64_t size = sparse_get_size(server.state);
+	int error = 0;
+	if (req->type == NBD_CMD_DISC) {
+		nbd_request_free(req);
+		return -1;
+	}
+	request->size = req->length;
+	request->offset = req->offset;
+	request->complete = nbd_complete;
+	request->opaque = req;
+	request->fua = (req->flags & NBD_CMD_FLAG_FUA) != 0;
+	switch (req->type) {
+		case NBD_CMD_READ:
+			request->op = SPARSE_OP_READ;
+			break;
+		case NBD_CMD_WRITE:
+			request->op = SPARSE_OP_WRITE;
+			break;
+		case NBD_CMD_FLUSH:
+			request->op = SPARSE_OP_FLUSH;
+			break;
+		case NBD_CMD_TRIM:
+			request->op = SPARSE_OP_TRIM;
+			break;
+		case NBD_CMD_CACHE:
+			request->op = SPARSE_OP_CACHE;
+			break;
+		case NBD_CMD_WRITE_ZEROES:
+			request->op = SPARSE_OP_ZERO;
+			if (!(req->flags & NBD_CMD_FLAG_NO_HOLE)) {
+				request->flags |= SPARSE_ZERO_MAY_TRIM;
+			}
+			if (req->flags & NBD_CMD_FLAG_FAST_ZERO) {
+				request->flags |= SPARSE_ZERO_FAST;
+			}
+			break;
+		case NBD_CMD_BLOCK_STATUS:
+			request->op = SPARSE_OP_EXTENTS;
+			request->extent = nbd_add_extent;
+			if (!conn->meta_allocation) {
+				error = EINVAL;
+			}
+			break;
+		default:
+			error = EINVAL;
+			break;
+	}
+	if (req->offset > size || req->length > size - req->offset) {
+		error = req->type == NBD_CMD_FLUSH ? error : EINVAL;
+	}
+	if (req->type == NBD_CMD_READ && req->length > MAX_PAYLOAD) {
+		error = EINVAL;
+	}
+	if (server.options.read_only &&
+		(req->type == NBD_CMD_WRITE || req->type == NBD_CMD_TRIM || req->type == NBD_CMD_WRITE_ZEROES)) {
+		error = EPERM;
+	}
+	__atomic_add_fetch(&conn->refs, 1, __ATOMIC_ACQ_REL);
+	if (error) {
+		nbd_reply(req, error);
+		return 0;
+	}
+	if (req->type == NBD_CMD_READ) {
+		req->reply = malloc(REPLY_HEADROOM + req->length);
+		request->buf = (char *) req->reply + REPLY_HEADROOM;
+	}
+	sparse_submit(server.state, request);
+	return 0;
+}
+
+/* reads whatever the connection has ready, negative once it should be closed */
+static int nbd_receive(struct nbd_conn *conn)
+{
+	for (int count = 0; count < RECEIVE_BATCH; ) {
+		struct nbd_request *req = conn->receiving;
+		ssize_t n;
+		if (req == NULL) {
+			n = read(conn->fd, conn->header + conn->header_length, NBD_REQUEST_SIZE - conn->header_length);
+		} else {
+			n = read(conn->fd, req->request.buf + conn->payload_length, req->length - conn->payload_length);
+		}
+		if (n == 0) {
+			return -1;
+		}
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+		}
+		if (req == NULL) {
+			conn->header_length += n;
+			if (conn->header_length < NBD_REQUEST_SIZE) {
+				continue;
+			}
+			conn->header_length = 0;
+			if (nbd_get32(conn->header) != NBD_REQUEST_MAGIC) {
+				return -1;
+			}
+			req = calloc(1, sizeof(*req));
+			req->conn = conn;
+			req->flags = nbd_get16(conn->header + 4);
+			req->type = nbd_get16(conn->header + 6);
+			req->cookie = nbd_get64(conn->header + 8);
+			req->offset = nbd_get64(conn->header + 16);
+			req->length = nbd_get32(conn->header + 24);
+			if (req->type == NBD_CMD_WRITE && req->length > 0) {
+				if (req->length > MAX_PAYLOAD) {
+					/* the payload cannot be skipped reliably */
+					nbd_request_free(req);
+					return -1;
+				}
+				req->reply = malloc(REPLY_HEADROOM + req->length);
+				req->request.buf = (char *) req->reply + REPLY_HEADROOM;
+				conn->receiving = req;
+				conn->payload_length = 0;
+				continue;
+			}
+		} else {
+			conn->payload_length += n;
+			if (conn->payload_length < req->length) {
+				continue;
+			}
+			conn->receiving = NULL;
+		}
+		if (nbd_dispatch(conn, req)) {
+			return -1;
+		}
+		count++;
+	}
+	return 0;
+}
+
+/* stops reading the connection, replies to requests in flight still go out */
+static void nbd_conn_drop(struct nbd_conn *conn)
+{
+	if (conn->receiving != NULL) {
+		nbd_request_free(conn->receiving);
+		conn->receiving = NULL;
+	}
+	__atomic_store_n(&conn->dropped, 1, __ATOMIC_SEQ_CST);
+	shutdown(conn->fd, SHUT_RD);
+}
+
+/* whether replies wait for room in the socket */
+static int nbd_conn_queued(struct nbd_conn *conn)
+{
+	pthread_mutex_lock(&conn->send_lock);
+	int queued = conn->replies != NULL;
+	pthread_mutex_unlock(&conn->send_lock);
+	return queued;
+}
+
+static void nbd_accept(int listen_fd)
+{
+	int fd = accept(listen_fd, NULL, NULL);
+	if (fd < 0) {
+		return;
+	}
+	int one = 1;
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	struct nbd_conn *conn = calloc(1, sizeof(*conn));
+	conn->fd = fd;
+	conn->refs = 1;
+	conn->replies_tail = &conn->replies;
+	pthread_mutex_init(&conn->send_lock, NULL);
+	pthread_t thread;
+	pthread_attr_t attr;
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	if (pthread_create(&thread, &attr, nbd_handshake_thread, conn)) {
+		nbd_conn_put(conn);
+	}
+	pthread_attr_destroy(&attr);
+}
+
+static void nbd_serve(int listen_fd)
+{
+	struct nbd_conn *conns = NULL, *conn, **prev;
+	int count = 0;
+	while (!server.stop) {
+		struct pollfd *pfds = calloc(2 + count, sizeof(struct pollfd));
+		struct nbd_conn **polled_conns = calloc(2 + count, sizeof(struct nbd_conn *));
+		pfds[0].fd = server.wake[0];
+		pfds[0].events = POLLIN;
+		pfds[1].fd = listen_fd;
+		pfds[1].events = POLLIN;
+		int n = 2;
+		for (conn = conns; conn != NULL; conn = conn->next, n++) {
+			polled_conns[n] = conn;
+			pfds[n].fd = conn->fd;
+			/* stop reading connections with too much in flight */
+			int inflight = __atomic_load_n(&conn->refs, __ATOMIC_ACQUIRE) - 1;
+			pfds[n].events = !conn->dropped && inflight < MAX_INFLIGHT ? POLLIN : 0;
+			if (nbd_conn_queued(conn)) {
+				pfds[n].events |= POLLOUT;
+			} else if (conn->dropped) {
+				/* nothing to do until its requests complete, a hangup would spin */
+				pfds[n].fd = -1;
+			}
+		}
+		int polled_count = n;
+		if (poll(pfds, polled_count, -1) < 0) {
+			free(pfds);
+			free(polled_conns);
+			if (errno == EINTR) {
+				continue;
+			}
+			perror("sparsebundle: poll");
+			break;
+		}
+		if (pfds[0].revents & POLLIN) {
+			char drain[64];
+			while (read(server.wake[0], drain, sizeof(drain)) > 0);
+			pthread_mutex_lock(&server.lock);
+			while (server.pending != NULL) {
+				conn = server.pending;
+				server.pending = conn->next;
+				conn->next = conns;
+				conns = conn;
+				count++;
+			}
+			pthread_mutex_unlock(&server.lock);
+		}
+		if (pfds[1].revents & POLLIN) {
+			nbd_accept(listen_fd);
+		}
+		/* connections added above are not in pfds */
+		n = 2;
+		for (prev = &conns; *prev != NULL; ) {
+			conn = *prev;
+			int polled = n < polled_count && polled_conns[n] == conn;
+			short revents = polled ? pfds[n].revents : 0;
+			if (revents & (POLLOUT | POLLERR | POLLHUP)) {
+				struct nbd_request *done = NULL;
+				pthread_mutex_lock(&conn->send_lock);
+				nbd_flush(conn, &done);
+				pthread_mutex_unlock(&conn->send_lock);
+				nbd_requests_free(done);
+			}
+			if (!conn->dropped && (revents & ~POLLOUT) && nbd_receive(conn) < 0) {
+				nbd_conn_drop(conn);
+			}
+			/* the loop's reference is the last one once its requests are done */
+			if (conn->dropped && __atomic_load_n(&conn->refs, __ATOMIC_SEQ_CST) == 1) {
+				*prev = conn->next;
+				count--;
+				nbd_conn_put(conn);
+			} else {
+				prev = &conn->next;
+			}
+			n += polled;
+		}
+		free(pfds);
+		free(polled_conns);
+	}
+	while (conns != NULL) {
+		conn = conns;
+		conns = conn->next;
+		if (!conn->dropped) {
+			nbd_conn_drop(conn);
+		}
+		nbd_conn_put(conn);
+	}
+}
+
+static int nbd_listen()
+{
+	int fd;
+	if (server.socket_path != NULL) {
+		struct sockaddr_un addr = { .sun_family = AF_UNIX };
+		if (strlen(server.socket_path) >= sizeof(addr.sun_path)) {
+			fprintf(stderr, "sparsebundle: socket path too long\n");
+			return -1;
+		}
+		strcpy(addr.sun_path, server.socket_path);
+		fd = socket(AF_UNIX, SOCK_STREAM, 0);
+		if (fd < 0 || bind(fd, (struct sockaddr *) &addr, sizeof(addr))) {
+			perror("sparsebundle: bind");
+			return -1;
+		}
+	} else {
+		/* localhost only, NBD has no authentication */
+		struct sockaddr_in addr = {
+			.sin_family = AF_INET,
+			.sin_port = htons(server.port),
+			.sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+		};
+		int one = 1;
+		fd = socket(AF_INET, SOCK_STREAM, 0);
+		if (fd >= 0) {
+			setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+		}
+		if (fd < 0 || bind(fd, (struct sockaddr *) &addr, sizeof(addr))) {
+			perror("sparsebundle: bind");
+			return -1;
+		}
+	}
+	if (listen(fd, SOMAXCONN)) {
+		perror("sparsebundle: listen");
+		return -1;
+	}
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+	return fd;
+}
+
+static void nbd_signal(int sig)
+{
+	server.stop = 1;
+	nbd_wake();
+}
+
+enum {
+	OPT_MAX_OPEN_BANDS = 256,
+	OPT_PREALLOC,
+	OPT_MMAP,
+	OPT_ACCESS,
+	OPT_DIRECT,
+};
+
+static const struct option long_options[] = {
+	{ "help", no_argument, NULL, 'h' },
+	{ "read-only", no_argument, NULL, 'r' },
+	{ "socket", required_argument, NULL, 's' },
+	{ "port", required_argument, NULL, 'p' },
+	{ "threads", required_argument, NULL, 't' },
+	{ "export-name", required_argument, NULL, 'e' },
+	{ "max-open-bands", required_argument, NULL, OPT_MAX_OPEN_BANDS },
+	{ "prealloc", required_argument, NULL, OPT_PREALLOC },
+	{ "mmap", no_argument, NULL, OPT_MMAP },
+	{ "access", required_argument, NULL, OPT_ACCESS },
+	{ "direct", no_argument, NULL, OPT_DIRECT },
+	{ NULL, 0, NULL, 0 }
+};
+
+static void usage(const char *progname)
+{
+	printf(
+"usage: %s [options] sparsebundle\n"
+"\n"
+"    -h   --help            print help\n"
+"    -r   --read-only       read only, bands are opened O_RDONLY\n"
+"    -s   --socket=PATH     listen on a unix socket\n"
+"    -p   --port=PORT       listen on localhost TCP (default: " xstr(DEFAULT_PORT) ")\n"
+"    -t   --threads=N       I/O worker threads (default: " xstr(DEFAULT_THREADS) ")\n"
+"    -e   --export-name=NAME name listed to clients (default: empty)\n"
+"    --max-open-bands=N     maximum band files open (default: " xstr(DEFAULT_MAX_OPEN_BANDS) ")\n"
+"    --prealloc=POLICY      none, full, keep-size or truncate (default: none)\n"
+"    --mmap                 serve band I/O from memory mappings\n"
+"    --access=PATTERN       normal, sequential or random, hints for --mmap\n"
+"    --direct               open bands O_DIRECT, bypassing the page cache\n", progname);
+}
+
+int main(int argc, char *argv[])
+{
+	int c;
+	server.export_name = "";
+	server.options.max_open_bands = DEFAULT_MAX_OPEN_BANDS;
+	while ((c = getopt_long(argc, argv, "hrs:p:t:e:", long_options, NULL)) != -1) {
+		switch (c) {
+			case 'h':
+				server.show_help = 1;
+				break;
+			case 'r':
+				server.options.read_only = 1;
+				break;
+			case 's':
+				server.socket_path = optarg;
+				break;
+			case 'p':
+				server.port = atoi(optarg);
+				break;
+			case 't':
+				server.threads = atoi(optarg);
+				break;
+			case 'e':
+				server.export_name = optarg;
+				break;
+			case OPT_MAX_OPEN_BANDS:
+				server.options.max_open_bands = atoi(optarg);
+				break;
+			case OPT_PREALLOC:
+				server.prealloc = optarg;
+				break;
+			case OPT_MMAP:
+				server.options.mmap_bands = 1;
+				break;
+			case OPT_ACCESS:
+				server.access = optarg;
+				break;
+			case OPT_DIRECT:
+				server.options.direct_io = 1;
+				break;
+			default:
+				usage(argv[0]);
+				return 1;
+		}
+	}
+
+	if (server.show_help) {
+		usage(argv[0]);
+		return 0;
+	}
+
+	if (optind != argc - 1) {
+		usage(argv[0]);
+		return 1;
+	}
+	server.options.path = argv[optind];
+
+	if (server.port <= 0 || server.port > 65535) {
+		fprintf(stderr, "sparsebundle: invalid port\n");
+		return 1;
+	}
+
+	if (server.prealloc &&
+		sparse_parse_prealloc(server.prealloc, &server.options.prealloc)) {
+		fprintf(stderr, "sparsebundle: invalid prealloc policy %s\n", server.prealloc);
+		return 1;
+	}
+
+	if (server.access &&
+		sparse_parse_access(server.access, &server.options.access)) {
+		fprintf(stderr, "sparsebundle: invalid access pattern %s\n", server.access);
+		return 1;
+	}
+
+	server.options.async_threads = server.threads > 0 ? server.threads : 1;
+	if (sparse_open(&server.state, &server.options)) {
+		fprintf(stderr, "sparsebundle: %s\n", sparse_get_error(server.state));
+		return 1;
+	}
+
+	int listen_fd = nbd_listen();
+	if (listen_fd < 0 || pipe(server.wake)) {
+		sparse_close(&server.state);
+		return 1;
+	}
+	fcntl(server.wake[0], F_SETFL, O_NONBLOCK);
+	fcntl(server.wake[1], F_SETFL, O_NONBLOCK);
+
+	struct sigaction sa = { .sa_handler = nbd_signal };
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	signal(SIGPIPE, SIG_IGN);
+
+	nbd_serve(listen_fd);
+
+	close(listen_fd);
+	if (server.socket_path != NULL) {
+		unlink(server.socket_path);
+	}
+	/* replies to what is still queued go out before the bundle closes */
+	sparse_close(&server.state);
+	return 0;
+}
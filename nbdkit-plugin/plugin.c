@@ -1,14 +1,23 @@
 #define NBDKIT_API_VERSION 2
 
+#include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#include <dirent.h>
 #include <nbdkit-plugin.h>
 
 #include "sparsebundle.h"
 
 #define DEFAULT_MAX_OPEN_BANDS 16
+#define BUNDLE_SUFFIX ".sparsebundle"
 
-#define THREAD_MODEL NBDKIT_THREAD_MODEL_SERIALIZE_ALL_REQUESTS
+#define THREAD_MODEL NBDKIT_THREAD_MODEL_PARALLEL
 
 #if defined(_WIN32) || defined(__MINGW32__) || defined(__CYGWIN__) || defined(_MSC_VER)
 #define WINDOWS_COMPAT
@@ -19,12 +28,51 @@ struct sparse_options sparse_options = {
 	.max_open_bands = DEFAULT_MAX_OPEN_BANDS
 };
 
+/* resize the bundle to this size before serving it, 0 to keep it */
+static int64_t sparse_resize_to = 0;
+
+/* serve every bundle in this directory as an export, instead of path */
+static char *sparse_directory = NULL;
+
+/*
+  statistics of the open exports are written here in the prometheus text
+  format, every stats-interval seconds if set and on SIGUSR1
+*/
+static char *sparse_stats_file = NULL;
+static int sparse_stats_interval = 0;
+static pthread_t sparse_stats_thread;
+static int sparse_stats_started = 0;
+static int sparse_stats_stop = 0;
+static pthread_mutex_t sparse_stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t sparse_stats_wake = PTHREAD_COND_INITIALIZER;
+/* set by SIGUSR1, the writer looks every second */
+static volatile sig_atomic_t sparse_stats_requested = 0;
+
+/*
+  one library state per export, shared by all connections so that they
+  share the band cache and a flush on one connection covers writes made
+  on the others. exports are opened on first connect and closed after
+  the last one.
+*/
+struct sparse_nbd_export {
+	sparse_handle_t state;
+	char *path;
+	int read_only;
+	int refs;
+	struct sparse_nbd_export *next;
+};
+
+static struct sparse_nbd_export *sparse_exports = NULL;
+static pthread_mutex_t sparse_export_lock = PTHREAD_MUTEX_INITIALIZER;
+
+#define STATE(handle) (((struct sparse_nbd_export *) (handle))->state)
+
 static int sparse_nbd_config(const char *key, const char *value)
 {
 	if (strcmp(key, "path") == 0) {
-		if (sparse_options.path != NULL) {
-			nbdkit_error("path can only be specified once");
-			return 1;
+		if (sparse_options.path != NULL || sparse_directory != NULL) {
+			nbdkit_error("only one of path or directory can be specified");
+			return -1;
 		}
 #if defined(WINDOWS_COMPAT)
 		sparse_options.path = strdup(value);
@@ -32,46 +80,419 @@ static int sparse_nbd_config(const char *key, const char *value)
 		sparse_options.path = nbdkit_realpath(value);
 #endif
 		nbdkit_debug("path is %s", sparse_options.path);
-	} else if (strcmp(key, "max-open-bands")) {
+	} else if (strcmp(key, "directory") == 0) {
+		if (sparse_options.path != NULL || sparse_directory != NULL) {
+			nbdkit_error("only one of path or directory can be specified");
+			return -1;
+		}
+#if defined(WINDOWS_COMPAT)
+		sparse_directory = strdup(value);
+#else
+		sparse_directory = nbdkit_realpath(value);
+#endif
+		nbdkit_debug("directory is %s", sparse_directory);
+	} else if (strcmp(key, "max-open-bands") == 0) {
 		int b = atoi(value);
 		if (b <= 0) {
 			nbdkit_error("invalid max-open-bands");
-			return 1;
+			return -1;
 		}
 		sparse_options.max_open_bands = atoi(value);
+	} else if (strcmp(key, "size") == 0) {
+		sparse_resize_to = nbdkit_parse_size(value);
+		if (sparse_resize_to <= 0) {
+			nbdkit_error("invalid size");
+			return -1;
+		}
+	} else if (strcmp(key, "prealloc") == 0) {
+		if (sparse_parse_prealloc(value, &sparse_options.prealloc)) {
+			nbdkit_error("invalid prealloc, expected none, full, keep-size or truncate");
+			return -1;
+		}
+	} else if (strcmp(key, "mmap") == 0) {
+		int b = nbdkit_parse_bool(value);
+		if (b < 0) {
+			return -1;
+		}
+		sparse_options.mmap_bands = b;
+	} else if (strcmp(key, "direct") == 0) {
+		int b = nbdkit_parse_bool(value);
+		if (b < 0) {
+			return -1;
+		}
+		sparse_options.direct_io = b;
+	} else if (strcmp(key, "access") == 0) {
+		if (sparse_parse_access(value, &sparse_options.access)) {
+			nbdkit_error("invalid access, expected normal, sequential or random");
+			return -1;
+		}
+	} else if (strcmp(key, "stats-file") == 0) {
+		free(sparse_stats_file);
+#if defined(WINDOWS_COMPAT)
+		sparse_stats_file = strdup(value);
+#else
+		sparse_stats_file = nbdkit_absolute_path(value);
+#endif
+	} else if (strcmp(key, "stats-interval") == 0) {
+		int b = atoi(value);
+		if (b <= 0) {
+			nbdkit_error("invalid stats-interval");
+			return -1;
+		}
+		sparse_stats_interval = b;
+	} else {
+		nbdkit_error("unknown parameter %s", key);
+		return -1;
 	}
 	return 0;
 }
 
 static int sparse_nbd_config_complete()
 {
+	if (sparse_stats_interval > 0 && sparse_stats_file == NULL) {
+		nbdkit_error("stats-interval needs stats-file");
+		return -1;
+	}
+	if (sparse_directory != NULL) {
+		if (sparse_resize_to > 0) {
+			nbdkit_error("size cannot be used with directory");
+			return -1;
+		}
+		/* one band fd budget for all exports */
+		if (sparse_cache_create(&sparse_options.cache, sparse_options.max_open_bands)) {
+			nbdkit_error("unable to create band cache");
+			return -1;
+		}
+		return 0;
+	}
 	if (sparse_options.path == NULL) {
-		nbdkit_error("path not supplied");
-		return 1;
+		nbdkit_error("path or directory not supplied");
+		return -1;
+	}
+	if (sparse_resize_to > 0) {
+		sparse_handle_t handle = NULL;
+		if (sparse_open(&handle, &sparse_options)) {
+			nbdkit_error("%s", sparse_get_error(handle));
+			return -1;
+		}
+		int r = sparse_resize(handle, sparse_resize_to);
+		sparse_close(&handle);
+		if (r < 0) {
+			nbdkit_error("unable to resize: %s", strerror(-r));
+			return -1;
+		}
+		nbdkit_debug("resized to %" PRId64, sparse_resize_to);
 	}
 	return 0;
 }
 
+static void sparse_nbd_unload()
+{
+	if (sparse_stats_started) {
+		pthread_mutex_lock(&sparse_stats_lock);
+		sparse_stats_stop = 1;
+		pthread_cond_signal(&sparse_stats_wake);
+		pthread_mutex_unlock(&sparse_stats_lock);
+		pthread_join(sparse_stats_thread, NULL);
+	}
+	free(sparse_stats_file);
+	if (sparse_options.cache != NULL) {
+		sparse_cache_release(&sparse_options.cache);
+	}
+	free(sparse_directory);
+	free((char *) sparse_options.path);
+}
+
+/* directory: export name of a directory entry, or NULL if it is not a bundle */
+static char *sparse_nbd_bundle_name(const char *entry)
+{
+	size_t length = strlen(entry);
+	size_t suffix_length = strlen(BUNDLE_SUFFIX);
+	if (entry[0] == '.' || length <= suffix_length || strcmp(entry + length - suffix_length, BUNDLE_SUFFIX)) {
+		return NULL;
+	}
+	return strndup(entry, length - suffix_length);
+}
+
+/* directory: the alphabetically first export name, NULL if there are none */
+static char *sparse_nbd_first_bundle()
+{
+	char *first = NULL;
+	struct dirent *entry;
+	DIR *dir = opendir(sparse_directory);
+	if (dir == NULL) {
+		nbdkit_error("unable to list %s: %m", sparse_directory);
+		return NULL;
+	}
+	while ((entry = readdir(dir)) != NULL) {
+		char *name = sparse_nbd_bundle_name(entry->d_name);
+		if (name != NULL && (first == NULL || strcmp(name, first) < 0)) {
+			free(first);
+			first = name;
+		} else {
+			free(name);
+		}
+	}
+	closedir(dir);
+	return first;
+}
+
+static int sparse_nbd_list_exports(int readonly, int is_tls, struct nbdkit_exports *exports)
+{
+	if (sparse_directory == NULL) {
+		return nbdkit_use_default_export(exports);
+	}
+	int r = 0;
+	struct dirent *entry;
+	DIR *dir = opendir(sparse_directory);
+	if (dir == NULL) {
+		nbdkit_error("unable to list %s: %m", sparse_directory);
+		return -1;
+	}
+	while (r == 0 && (entry = readdir(dir)) != NULL) {
+		char *name = sparse_nbd_bundle_name(entry->d_name);
+		if (name != NULL) {
+			r = nbdkit_add_export(exports, name, NULL);
+			free(name);
+		}
+	}
+	closedir(dir);
+	return r;
+}
+
+static const char *sparse_nbd_default_export(int readonly, int is_tls)
+{
+	if (sparse_directory == NULL) {
+		return "";
+	}
+	char *name = sparse_nbd_first_bundle();
+	if (name == NULL) {
+		nbdkit_error("no bundles in %s", sparse_directory);
+		return NULL;
+	}
+	const char *r = nbdkit_strdup_intern(name);
+	free(name);
+	return r;
+}
+
+/* bundle path served under an export name, NULL if there is no such export */
+static char *sparse_nbd_export_path(const char *name)
+{
+	if (sparse_directory == NULL) {
+		return strdup(sparse_options.path);
+	}
+	char *first = NULL;
+	if (name == NULL || name[0] == '\0') {
+		name = first = sparse_nbd_first_bundle();
+		if (name == NULL) {
+			return NULL;
+		}
+	}
+	if (name[0] == '.' || strchr(name, '/') != NULL) {
+		nbdkit_error("invalid export name %s", name);
+		free(first);
+		return NULL;
+	}
+	size_t length = strlen(sparse_directory) + strlen(name) + strlen(BUNDLE_SUFFIX) + 2;
+	char *path = malloc(length);
+	snprintf(path, length, "%s/%s" BUNDLE_SUFFIX, sparse_directory, name);
+	free(first);
+	return path;
+}
+
 static void *sparse_nbd_open(int readonly)
 {
-	sparse_handle_t handle = NULL;
-	int ret = sparse_open(&handle, &sparse_options);
-	if (ret) {
-		nbdkit_error("%s", sparse_get_error(handle));
+	struct sparse_nbd_export *export;
+	char *path = sparse_nbd_export_path(nbdkit_export_name());
+	if (path == NULL) {
+		return NULL;
+	}
+	pthread_mutex_lock(&sparse_export_lock);
+	for (export = sparse_exports; export != NULL; export = export->next) {
+		if (strcmp(export->path, path) == 0) {
+			break;
+		}
 	}
-	return handle;
+	if (export == NULL) {
+		export = calloc(1, sizeof(*export));
+		struct sparse_options options = sparse_options;
+		options.path = path;
+		options.read_only = readonly;
+		if (sparse_open(&export->state, &options)) {
+			nbdkit_error("%s: %s", path, sparse_get_error(export->state));
+			pthread_mutex_unlock(&sparse_export_lock);
+			free(export);
+			free(path);
+			return NULL;
+		}
+		export->path = path;
+		export->read_only = readonly;
+		export->next = sparse_exports;
+		sparse_exports = export;
+		path = NULL;
+	} else if (export->read_only && !readonly) {
+		nbdkit_error("export is open read only");
+		pthread_mutex_unlock(&sparse_export_lock);
+		free(path);
+		return NULL;
+	}
+	export->refs++;
+	pthread_mutex_unlock(&sparse_export_lock);
+	free(path);
+	return export;
+}
+
+static void sparse_nbd_close(void *handle)
+{
+	struct sparse_nbd_export *export = handle;
+	pthread_mutex_lock(&sparse_export_lock);
+	if (--export->refs == 0) {
+		struct sparse_nbd_export **prev = &sparse_exports;
+		while (*prev != export) {
+			prev = &(*prev)->next;
+		}
+		*prev = export->next;
+		sparse_close(&export->state);
+		free(export->path);
+		free(export);
+	}
+	pthread_mutex_unlock(&sparse_export_lock);
+}
+
+/* writes the stats of the open exports, through a rename so that readers never see half */
+static int sparse_nbd_write_stats()
+{
+	struct sparse_nbd_export *export;
+	int count = 0, r = 0;
+	pthread_mutex_lock(&sparse_export_lock);
+	for (export = sparse_exports; export != NULL; export = export->next) {
+		count++;
+	}
+	struct sparse_nbd_export **held = malloc((count + 1) * sizeof(*held));
+	sparse_handle_t *states = malloc((count + 1) * sizeof(*states));
+	char **names = malloc((count + 1) * sizeof(*names));
+	count = 0;
+	for (export = sparse_exports; export != NULL; export = export->next) {
+		/* the export name, the bundle without its suffix */
+		const char *base = strrchr(export->path, '/');
+		base = base != NULL ? base + 1 : export->path;
+		names[count] = sparse_nbd_bundle_name(base);
+		if (names[count] == NULL) {
+			names[count] = strdup(base);
+		}
+		export->refs++;
+		held[count] = export;
+		states[count] = export->state;
+		count++;
+	}
+	pthread_mutex_unlock(&sparse_export_lock);
+
+	size_t length = strlen(sparse_stats_file) + 5;
+	char *tmp_path = malloc(length);
+	snprintf(tmp_path, length, "%s.tmp", sparse_stats_file);
+	FILE *f = fopen(tmp_path, "w");
+	if (f == NULL) {
+		r = -errno;
+	} else {
+		r = sparse_dump_prometheus(f, states, sparse_directory != NULL ? (const char **) names : NULL, count);
+		if (fclose(f) && r == 0) {
+			r = -errno;
+		}
+		if (r == 0 && rename(tmp_path, sparse_stats_file)) {
+			r = -errno;
+		}
+		if (r < 0) {
+			unlink(tmp_path);
+		}
+	}
+	for (int i = 0; i < count; i++) {
+		/* may close an export whose last connection went away meanwhile */
+		sparse_nbd_close(held[i]);
+		free(names[i]);
+	}
+	free(tmp_path);
+	free(held);
+	free(states);
+	free(names);
+	return r;
+}
+
+inline static time_t sparse_nbd_now()
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec;
+}
+
+static void *sparse_nbd_stats_loop(void *arg)
+{
+	struct timespec deadline;
+	time_t next = sparse_nbd_now() + sparse_stats_interval;
+	pthread_mutex_lock(&sparse_stats_lock);
+	while (!sparse_stats_stop) {
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_sec++;
+		pthread_cond_timedwait(&sparse_stats_wake, &sparse_stats_lock, &deadline);
+		time_t now = sparse_nbd_now();
+		if (sparse_stats_stop || (!sparse_stats_requested &&
+			(sparse_stats_interval == 0 || now < next))) {
+			continue;
+		}
+		sparse_stats_requested = 0;
+		next = now + sparse_stats_interval;
+		pthread_mutex_unlock(&sparse_stats_lock);
+		int r = sparse_nbd_write_stats();
+		if (r < 0) {
+			nbdkit_error("unable to write %s: %s", sparse_stats_file, strerror(-r));
+		}
+		pthread_mutex_lock(&sparse_stats_lock);
+	}
+	pthread_mutex_unlock(&sparse_stats_lock);
+	return NULL;
+}
+
+static void sparse_nbd_stats_signal(int signum)
+{
+	sparse_stats_requested = 1;
+}
+
+/* after nbdkit forks into the background, threads do not survive fork */
+static int sparse_nbd_after_fork()
+{
+	if (sparse_stats_file == NULL) {
+		return 0;
+	}
+	if (pthread_create(&sparse_stats_thread, NULL, sparse_nbd_stats_loop, NULL)) {
+		nbdkit_error("unable to start the stats thread");
+		return -1;
+	}
+	sparse_stats_started = 1;
+#ifdef SIGUSR1
+	struct sigaction action;
+	memset(&action, 0, sizeof(action));
+	action.sa_handler = sparse_nbd_stats_signal;
+	action.sa_flags = SA_RESTART;
+	sigemptyset(&action.sa_mask);
+	sigaction(SIGUSR1, &action, NULL);
+#endif
+	return 0;
+}
+
+static int sparse_nbd_can_multi_conn(void *handle)
+{
+	return 1;
 }
 
 static int64_t sparse_nbd_get_size (void *handle)
 {
-	size_t size = sparse_get_size((sparse_handle_t) handle);
+	size_t size = sparse_get_size(STATE(handle));
 	nbdkit_debug("size is %lu", size);
 	return size;
 }
 
 static int sparse_nbd_pread(void *handle, void *buf, uint32_t count, uint64_t offset, uint32_t flags)
 {
-	int r = sparse_pread((sparse_handle_t) handle, buf, count, offset);
+	int r = sparse_pread(STATE(handle), buf, count, offset);
 	if (r < 0) {
 		errno = -r;
 		return -1;
@@ -81,7 +502,7 @@ static int sparse_nbd_pread(void *handle, void *buf, uint32_t count, uint64_t of
 
 static int sparse_nbd_pwrite(void *handle, const void *buf, uint32_t count, uint64_t offset, uint32_t flags)
 {
-	int r = sparse_pwrite((sparse_handle_t) handle, buf, count, offset);
+	int r = sparse_pwrite(STATE(handle), buf, count, offset);
 	if (r < 0) {
 		errno = -r;
 		return -1;
@@ -91,7 +512,7 @@ static int sparse_nbd_pwrite(void *handle, const void *buf, uint32_t count, uint
 
 static int sparse_nbd_flush(void *handle, uint32_t flags)
 {
-	int r = sparse_flush((sparse_handle_t) handle);
+	int r = sparse_flush(STATE(handle));
 	if (r < 0) {
 		errno = -r;
 		return -1;
@@ -101,7 +522,83 @@ static int sparse_nbd_flush(void *handle, uint32_t flags)
 
 static int sparse_nbd_trim(void *handle, uint32_t count, uint64_t offset, uint32_t flags)
 {
-	int r = sparse_trim((sparse_handle_t) handle, count, offset);
+	int r = sparse_trim(STATE(handle), count, offset);
+	if (r < 0) {
+		errno = -r;
+		return -1;
+	}
+	return 0;
+}
+
+static int sparse_nbd_can_zero(void *handle)
+{
+	return 1;
+}
+
+static int sparse_nbd_can_fast_zero(void *handle)
+{
+	return 1;
+}
+
+static int sparse_nbd_zero(void *handle, uint32_t count, uint64_t offset, uint32_t flags)
+{
+	int zero_flags = 0;
+	if (flags & NBDKIT_FLAG_MAY_TRIM) {
+		zero_flags |= SPARSE_ZERO_MAY_TRIM;
+	}
+	if (flags & NBDKIT_FLAG_FAST_ZERO) {
+		zero_flags |= SPARSE_ZERO_FAST;
+	}
+	int r = sparse_zero(STATE(handle), count, offset, zero_flags);
+	if (r < 0) {
+		errno = -r;
+		return -1;
+	}
+	return 0;
+}
+
+static int sparse_nbd_can_cache(void *handle)
+{
+	return NBDKIT_CACHE_NATIVE;
+}
+
+static int sparse_nbd_cache(void *handle, uint32_t count, uint64_t offset, uint32_t flags)
+{
+	int r = sparse_prefetch(STATE(handle), count, offset);
+	if (r < 0) {
+		errno = -r;
+		return -1;
+	}
+	return 0;
+}
+
+static int sparse_nbd_can_extents(void *handle)
+{
+	return 1;
+}
+
+struct sparse_nbd_extents {
+	struct nbdkit_extents *extents;
+	int req_one;
+};
+
+static int sparse_nbd_add_extent(void *opaque, off_t offset, size_t length, int flags)
+{
+	struct sparse_nbd_extents *e = opaque;
+	uint32_t type = flags & SPARSE_EXTENT_HOLE ? NBDKIT_EXTENT_HOLE | NBDKIT_EXTENT_ZERO : 0;
+	if (nbdkit_add_extent(e->extents, offset, length, type) == -1) {
+		return -errno;
+	}
+	return e->req_one;
+}
+
+static int sparse_nbd_extents(void *handle, uint32_t count, uint64_t offset, uint32_t flags, struct nbdkit_extents *extents)
+{
+	struct sparse_nbd_extents e = {
+		.extents = extents,
+		.req_one = !!(flags & NBDKIT_FLAG_REQ_ONE),
+	};
+	int r = sparse_extents(STATE(handle), count, offset, sparse_nbd_add_extent, &e);
 	if (r < 0) {
 		errno = -r;
 		return -1;
@@ -113,12 +610,25 @@ static struct nbdkit_plugin plugin = {
 	.name              = "sparsebundle",
 	.config            = sparse_nbd_config,
 	.config_complete   = sparse_nbd_config_complete,
+	.unload            = sparse_nbd_unload,
+	.after_fork        = sparse_nbd_after_fork,
+	.list_exports      = sparse_nbd_list_exports,
+	.default_export    = sparse_nbd_default_export,
 	.open              = sparse_nbd_open,
+	.close             = sparse_nbd_close,
 	.get_size          = sparse_nbd_get_size,
+	.can_multi_conn    = sparse_nbd_can_multi_conn,
 	.pread             = sparse_nbd_pread,
 	.pwrite            = sparse_nbd_pwrite,
 	.flush             = sparse_nbd_flush,
-	.trim              = sparse_nbd_trim
+	.trim              = sparse_nbd_trim,
+	.can_zero          = sparse_nbd_can_zero,
+	.can_fast_zero     = sparse_nbd_can_fast_zero,
+	.zero              = sparse_nbd_zero,
+	.can_cache         = sparse_nbd_can_cache,
+	.cache             = sparse_nbd_cache,
+	.can_extents       = sparse_nbd_can_extents,
+	.extents           = sparse_nbd_extents,
 };
 
 NBDKIT_REGISTER_PLUGIN(plugin)
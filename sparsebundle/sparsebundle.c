@@ -5,6 +5,7 @@
 */
 
 #define _POSIX_C_SOURCE 200809L
+#define _GNU_SOURCE
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -13,8 +14,15 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <stddef.h>
+#include <stdint.h>
+#include <limits.h>
 #include <pthread.h>
+#include <setjmp.h>
+#include <signal.h>
+#include <time.h>
+#include <dirent.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 
 #include <yxml.h>
 #include <uthash.h>
@@ -27,32 +35,176 @@
 #define MAX(a,b) (((a)>(b))?(a):(b))
 
 #define XML_BUFFER_SIZE (1 << 10)
+#define RECLAIM_BATCH_SIZE 64
+#define PREALLOC_CHUNK_SIZE (1 << 20)
+#define DIRECT_ALIGN 4096
+/* one huge page, also the most a bounced request moves at once */
+#define BUFFER_SIZE (2 << 20)
+#define BUFFER_POOL_MAX 16
+#define ZERO_BUFFER_SIZE (64 << 10)
 #define ARRAY_SIZE(x) (sizeof(x) / sizeof(x[0]))
+/* counter slots, threads share them round robin */
+#define STATS_SLOTS 16
+/* prometheus histograms have a bucket per power of two from 2^10ns, about 1us */
+#define PROMETHEUS_FIRST_BUCKET 36
 
 struct sparse_band {
 	int index;
+	/* owner, for evicting through a shared cache */
+	struct sparse_state *state;
 	/* either fd, or negative errno */
 	int fd;
+	/* end of the range preallocated by SPARSE_PREALLOC_KEEP_SIZE, a hint */
+	off_t prealloc_end;
+	/* mmap_bands: mapping of the whole band, or NULL to use pread/pwrite */
+	char *map;
+	size_t map_length;
+	/* mmap_bands: file size, only the mapping below it is backed */
+	off_t size;
+	/* mmap_bands: written through the mapping since the last msync */
+	int dirty;
+	/* written since the last sparse_sync */
+	int unsynced;
+	/* bytes allocated to the file as counted in state->usage, -1 once trimmed */
+	off_t allocated;
+	/* serializes counting allocated against the file */
+	pthread_mutex_t account_lock;
+	/* holders, raised under cache->lock, eviction skips held bands */
+	int refs;
+	/* direct_io: serializes read-modify-write of partial blocks */
+	pthread_mutex_t rmw_lock;
 	pthread_rwlock_t rwlock;
 	UT_hash_handle hh;
 	struct sparse_band *prev;
 	struct sparse_band *next;
 };
 
+/* a trimmed band whose file is waiting to be removed by the reclaimer */
+struct sparse_dead_band {
+	int index;
+	/* set while the reclaimer is removing the band file */
+	int busy;
+	/* detached cache entry still to be closed, or NULL */
+	struct sparse_band *band;
+	UT_hash_handle hh;
+};
+
+/* a band evicted from the cache before its writes were synced */
+struct sparse_unsynced_band {
+	int index;
+	UT_hash_handle hh;
+};
+
+/*
+  what state->usage counts for a band file no longer cached. a file that
+  writeback is busy with can show blocks both reserved and allocated, so
+  each count of the file goes from the last one rather than starting over.
+*/
+struct sparse_counted_band {
+	int index;
+	off_t allocated;
+	UT_hash_handle hh;
+};
+
+/* aligned bounce buffer for direct_io */
+struct sparse_buffer {
+	char *data;
+	int huge;
+	struct sparse_buffer *next;
+};
+
+/* band fds and mappings, shared by every bundle opened with it */
+struct sparse_cache {
+	int max_open_bands;
+	int count;
+	/* least recently used first, bands of all bundles */
+	struct sparse_band *bands_dl;
+	int refs;
+	pthread_mutex_t lock;
+};
+
+enum sparse_stat {
+#define SPARSE_STAT_INDEX(name, description) SPARSE_STAT_##name,
+	SPARSE_STATS(SPARSE_STAT_INDEX)
+#undef SPARSE_STAT_INDEX
+	SPARSE_STAT_COUNT,
+};
+
+enum sparse_latency {
+#define SPARSE_LATENCY_INDEX(name, description) SPARSE_LATENCY_##name,
+	SPARSE_LATENCIES(SPARSE_LATENCY_INDEX)
+#undef SPARSE_LATENCY_INDEX
+	SPARSE_LATENCY_COUNT,
+};
+
+/* one cache line or more, so that threads do not write to the same one */
+struct sparse_stats_slot {
+	uint64_t counters[SPARSE_STAT_COUNT];
+	struct sparse_histogram latencies[SPARSE_LATENCY_COUNT];
+} __attribute__((aligned(64)));
+
 struct sparse_info {
 	int band_size;
-	int size;
+	uint64_t size;
 	int bundle_backingstore_version;
+	/* where the size value sits in Info.plist, for rewriting it */
+	long size_start;
+	long size_end;
 };
 
 struct sparse_state {
 	struct sparse_options options;
 	struct sparse_info info;
 	struct {
-		struct sparse_band *bands_dl;
+		struct sparse_cache *cache;
+		/* this bundle's bands, protected by cache->lock */
 		struct sparse_band *bands_ht;
-		pthread_mutex_t lock;
+		/* detached bands still being closed outside the lock, protected by cache->lock */
+		int closing;
+		pthread_cond_t closed;
 	} lru;
+	/* protected by lru.cache->lock */
+	struct {
+		struct sparse_dead_band *dead_ht;
+		pthread_t thread;
+		pthread_cond_t wake;
+		pthread_cond_t done;
+		int bands_fd;
+		int started;
+		int stop;
+		int error;
+	} reclaim;
+	/* updated atomically as band files change, seeded by a scan at open */
+	struct sparse_usage usage;
+	/* protected by lru.cache->lock */
+	struct sparse_counted_band *counted_ht;
+	/* protected by lru.cache->lock */
+	struct {
+		struct sparse_unsynced_band *evicted_ht;
+		/* band files were created since the last sync */
+		int bands_dir;
+	} sync;
+	pthread_mutex_t resize_lock;
+	struct {
+		struct sparse_buffer *free;
+		int count;
+		pthread_mutex_t lock;
+	} pool;
+	/* async_threads: submitted requests waiting for a worker */
+	struct {
+		struct sparse_request *head;
+		struct sparse_request *tail;
+		pthread_t *threads;
+		int count;
+		int stop;
+		pthread_mutex_t lock;
+		pthread_cond_t wake;
+	} queue;
+	/* counted without locks, summed by sparse_get_stats */
+	struct sparse_stats_slot stats[STATS_SLOTS];
+	/* read only: which bands exist, bands never come or go while open */
+	uint8_t *band_map;
+	int band_map_count;
 	const char *error;
 };
 
@@ -140,32 +292,240 @@ inline static int epwrite(int fd, void *buf, size_t count, off_t offset)
 	return r >= 0 ? r : -errno;
 }
 
-/* locking lru.lock required */
-inline static struct sparse_band *sparse_open_band(struct sparse_state *state, int id, int create)
+static int sparse_stats_next_slot = 0;
+static __thread int sparse_stats_slot = -1;
+
+inline static struct sparse_stats_slot *sparse_stats_slot_of(struct sparse_state *state)
 {
-	/* initialize band */
-	struct sparse_band *band = calloc(1, sizeof(*band));
-	band->index = id;
-	UT_string *path; utstring_new(path);
-	utstring_printf(path, "%s/bands/%x", state->options.path, id);
-	band->fd = eopen(utstring_body(path), O_RDWR | (create ? O_CREAT : 0), 0666);
-	utstring_free(path);
-	pthread_rwlock_init(&band->rwlock, NULL);
-	HASH_ADD_INT(state->lru.bands_ht, index, band);
-	DL_APPEND(state->lru.bands_dl, band);
-	return band;
+	if (sparse_stats_slot < 0) {
+		sparse_stats_slot = __atomic_fetch_add(&sparse_stats_next_slot, 1, __ATOMIC_RELAXED) % STATS_SLOTS;
+	}
+	return &state->stats[sparse_stats_slot];
+}
+
+inline static void sparse_count(struct sparse_state *state, enum sparse_stat stat, uint64_t n)
+{
+	__atomic_fetch_add(&sparse_stats_slot_of(state)->counters[stat], n, __ATOMIC_RELAXED);
+}
+
+inline static uint64_t sparse_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+inline static int sparse_histogram_bucket(uint64_t ns)
+{
+	if (ns < 4) {
+		return ns;
+	}
+	int exponent = 63 - __builtin_clzll(ns);
+	if (exponent >= 40) {
+		return SPARSE_HISTOGRAM_BUCKETS - 1;
+	}
+	return (exponent - 1) * 4 + ((ns >> (exponent - 2)) & 3);
+}
+
+/* records the time since start, from sparse_now */
+inline static void sparse_record(struct sparse_state *state, enum sparse_latency latency, uint64_t start)
+{
+	uint64_t ns = sparse_now() - start;
+	struct sparse_histogram *histogram = &sparse_stats_slot_of(state)->latencies[latency];
+	__atomic_fetch_add(&histogram->count, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&histogram->sum, ns, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&histogram->buckets[sparse_histogram_bucket(ns)], 1, __ATOMIC_RELAXED);
+}
+
+/* timed versions of the band file syscalls */
+inline static int sparse_sys_pread(struct sparse_state *state, int fd, void *buf, size_t count, off_t offset)
+{
+	if (fd < 0) {
+		return fd;
+	}
+	uint64_t start = sparse_now();
+	int r = epread(fd, buf, count, offset);
+	sparse_record(state, SPARSE_LATENCY_sys_pread, start);
+	return r;
+}
+
+inline static int sparse_sys_pwrite(struct sparse_state *state, int fd, void *buf, size_t count, off_t offset)
+{
+	if (fd < 0) {
+		return fd;
+	}
+	uint64_t start = sparse_now();
+	int r = epwrite(fd, buf, count, offset);
+	sparse_record(state, SPARSE_LATENCY_sys_pwrite, start);
+	return r;
+}
+
+inline static int sparse_sys_fsync(struct sparse_state *state, int fd, int datasync)
+{
+	uint64_t start = sparse_now();
+#ifdef HAVE_FDATASYNC
+	int r = (datasync ? fdatasync(fd) : fsync(fd)) ? -errno : 0;
+#else
+	int r = fsync(fd) ? -errno : 0;
+#endif
+	sparse_record(state, SPARSE_LATENCY_sys_fsync, start);
+	return r;
+}
+
+/*
+  band files can be truncated behind our back, touching a mapping past
+  the end of the file raises SIGBUS. copies from and to mappings are
+  guarded so that a fault turns into an error instead of a crash.
+  the handler is only installed while a bundle is open with mmap_bands.
+*/
+static __thread sigjmp_buf *volatile sparse_sigbus_jmp;
+static struct sigaction sparse_sigbus_prev;
+static pthread_mutex_t sparse_sigbus_lock = PTHREAD_MUTEX_INITIALIZER;
+/* bundles open with mmap_bands, protected by sparse_sigbus_lock */
+static int sparse_sigbus_users;
+
+static void sparse_sigbus_handler(int sig, siginfo_t *info, void *ctx)
+{
+	if (sparse_sigbus_jmp != NULL) {
+		siglongjmp(*sparse_sigbus_jmp, 1);
+	}
+	/* not raised by a guarded copy */
+	if (sparse_sigbus_prev.sa_flags & SA_SIGINFO) {
+		sparse_sigbus_prev.sa_sigaction(sig, info, ctx);
+	} else if (sparse_sigbus_prev.sa_handler != SIG_DFL && sparse_sigbus_prev.sa_handler != SIG_IGN) {
+		sparse_sigbus_prev.sa_handler(sig);
+	} else {
+		/* faults again on return, this time fatally */
+		sigaction(SIGBUS, &sparse_sigbus_prev, NULL);
+	}
+}
+
+static void sparse_sigbus_acquire(void)
+{
+	pthread_mutex_lock(&sparse_sigbus_lock);
+	if (sparse_sigbus_users++ == 0) {
+		struct sigaction sa;
+		memset(&sa, 0, sizeof(sa));
+		sa.sa_sigaction = sparse_sigbus_handler;
+		/* NODEFER, so jumping out does not need to restore the signal mask */
+		sa.sa_flags = SA_SIGINFO | SA_NODEFER;
+		sigemptyset(&sa.sa_mask);
+		sigaction(SIGBUS, &sa, &sparse_sigbus_prev);
+	}
+	pthread_mutex_unlock(&sparse_sigbus_lock);
+}
+
+static void sparse_sigbus_release(void)
+{
+	struct sigaction current;
+	pthread_mutex_lock(&sparse_sigbus_lock);
+	if (--sparse_sigbus_users == 0 && sigaction(SIGBUS, NULL, &current) == 0 &&
+		(current.sa_flags & SA_SIGINFO) && current.sa_sigaction == sparse_sigbus_handler) {
+		/* the last mapping is gone, unless the application took SIGBUS over since */
+		sigaction(SIGBUS, &sparse_sigbus_prev, NULL);
+	}
+	pthread_mutex_unlock(&sparse_sigbus_lock);
+}
+
+inline static int sparse_map_copy(void *dst, const void *src, size_t count)
+{
+	sigjmp_buf jmp;
+	if (sigsetjmp(jmp, 0)) {
+		sparse_sigbus_jmp = NULL;
+		return -EFAULT;
+	}
+	sparse_sigbus_jmp = &jmp;
+	memcpy(dst, src, count);
+	sparse_sigbus_jmp = NULL;
+	return 0;
 }
 
-/* locking lru.lock required */
-inline static int sparse_close_band(struct sparse_state *state, struct sparse_band *band)
+/* length of the band, the last one may be cut short by the image size */
+inline static off_t sparse_band_length(struct sparse_state *state, int id)
+{
+	off_t start = (off_t)id * state->info.band_size;
+	off_t size = __atomic_load_n(&state->info.size, __ATOMIC_RELAXED);
+	return MIN(state->info.band_size, MAX(size - start, 0));
+}
+
+/* best effort, a failed preallocation only costs fragmentation */
+inline static void sparse_prealloc_band(struct sparse_state *state, struct sparse_band *band)
+{
+	off_t length = sparse_band_length(state, band->index);
+	if (length <= 0) {
+		return;
+	}
+	switch (state->options.prealloc) {
+		case SPARSE_PREALLOC_FULL:
+#if defined(HAVE_FALLOCATE)
+			fallocate(band->fd, 0, 0, length);
+#elif defined(HAVE_POSIX_FALLOCATE)
+			posix_fallocate(band->fd, 0, length);
+#endif
+			break;
+		case SPARSE_PREALLOC_TRUNCATE:
+			ftruncate(band->fd, length);
+			break;
+		default:
+			break;
+	}
+}
+
+/* extends the KEEP_SIZE preallocation to cover a write, band must be held */
+inline static void sparse_prealloc_write(struct sparse_state *state, struct sparse_band *band, off_t offset, size_t count)
+{
+#if defined(HAVE_FALLOCATE) && defined(FALLOC_FL_KEEP_SIZE)
+	off_t end = offset + count;
+	off_t prealloc_end = __atomic_load_n(&band->prealloc_end, __ATOMIC_RELAXED);
+	if (band->fd < 0 || end <= prealloc_end) {
+		return;
+	}
+	off_t start = MAX(offset - offset % PREALLOC_CHUNK_SIZE, prealloc_end);
+	end = MIN(end + PREALLOC_CHUNK_SIZE - 1 - (end - 1) % PREALLOC_CHUNK_SIZE,
+		sparse_band_length(state, band->index));
+	if (end > start) {
+		fallocate(band->fd, FALLOC_FL_KEEP_SIZE, start, end - start);
+	}
+	__atomic_store_n(&band->prealloc_end, end, __ATOMIC_RELAXED);
+#endif
+}
+
+inline static void sparse_map_band(struct sparse_state *state, struct sparse_band *band)
+{
+	static const int advice[] = {
+		[SPARSE_ACCESS_NORMAL] = POSIX_MADV_NORMAL,
+		[SPARSE_ACCESS_SEQUENTIAL] = POSIX_MADV_SEQUENTIAL,
+		[SPARSE_ACCESS_RANDOM] = POSIX_MADV_RANDOM,
+	};
+	struct stat st;
+	if (fstat(band->fd, &st)) {
+		return;
+	}
+	int prot = PROT_READ | (state->options.read_only ? 0 : PROT_WRITE);
+	void *map = mmap(NULL, state->info.band_size, prot, MAP_SHARED, band->fd, 0);
+	if (map == MAP_FAILED) {
+		/* fall back to pread/pwrite for this band */
+		return;
+	}
+	posix_madvise(map, state->info.band_size, advice[state->options.access]);
+	band->map = map;
+	band->map_length = state->info.band_size;
+	band->size = st.st_size;
+}
+
+/* band must be detached from the cache */
+inline static int sparse_free_band(struct sparse_band *band)
 {
 	int r = 0;
-	HASH_DEL(state->lru.bands_ht, band);
-	DL_DELETE(state->lru.bands_dl, band);
 	/* wait for operation to complete on the band */
 	pthread_rwlock_wrlock(&band->rwlock);
 	pthread_rwlock_unlock(&band->rwlock);
 	pthread_rwlock_destroy(&band->rwlock);
+	pthread_mutex_destroy(&band->rmw_lock);
+	pthread_mutex_destroy(&band->account_lock);
+	if (band->map != NULL) {
+		munmap(band->map, band->map_length);
+	}
 	if (band->fd >= 0) {
 		r = close(band->fd);
 	}
@@ -173,7 +533,201 @@ inline static int sparse_close_band(struct sparse_state *state, struct sparse_ba
 	return r;
 }
 
-/* locking lru.lock required */
+/* locking lru.cache->lock required */
+inline static void sparse_detach_band(struct sparse_state *state, struct sparse_band *band)
+{
+	if (__atomic_load_n(&band->unsynced, __ATOMIC_ACQUIRE)) {
+		/* the next sync reopens the file */
+		struct sparse_unsynced_band *unsynced = NULL;
+		HASH_FIND_INT(state->sync.evicted_ht, &band->index, unsynced);
+		if (unsynced == NULL) {
+			unsynced = calloc(1, sizeof(*unsynced));
+			unsynced->index = band->index;
+			HASH_ADD_INT(state->sync.evicted_ht, index, unsynced);
+		}
+	}
+	if (band->fd >= 0 && band->allocated >= 0) {
+		struct sparse_counted_band *counted = NULL;
+		HASH_FIND_INT(state->counted_ht, &band->index, counted);
+		if (counted == NULL) {
+			counted = calloc(1, sizeof(*counted));
+			counted->index = band->index;
+			HASH_ADD_INT(state->counted_ht, index, counted);
+		}
+		counted->allocated = band->allocated;
+	}
+	HASH_DEL(state->lru.bands_ht, band);
+	DL_DELETE(state->lru.cache->bands_dl, band);
+	state->lru.cache->count--;
+}
+
+/* counts the space of the band file again after changing it, band must be held */
+inline static void sparse_account_band(struct sparse_state *state, struct sparse_band *band)
+{
+	struct stat st;
+	if (band->fd < 0) {
+		return;
+	}
+	pthread_mutex_lock(&band->account_lock);
+	if (band->allocated >= 0 && fstat(band->fd, &st) == 0) {
+		__atomic_add_fetch(&state->usage.allocated, (off_t)st.st_blocks * 512 - band->allocated, __ATOMIC_RELAXED);
+		band->allocated = (off_t)st.st_blocks * 512;
+	}
+	pthread_mutex_unlock(&band->account_lock);
+}
+
+/*
+  queues a detached band on victims, for sparse_free_bands to close once
+  the lock is dropped. locking lru.cache->lock required
+*/
+inline static void sparse_retire_band(struct sparse_band *band, struct sparse_band **victims)
+{
+	band->state->lru.closing++;
+	LL_PREPEND(*victims, band);
+}
+
+/* locking lru.cache->lock required */
+inline static void sparse_close_band(struct sparse_state *state, struct sparse_band *band, struct sparse_band **victims)
+{
+	sparse_detach_band(state, band);
+	sparse_retire_band(band, victims);
+}
+
+/*
+  closes the bands retired under the lock, waiting for their holders
+  without keeping every other band of the cache waiting too
+*/
+inline static int sparse_free_bands(struct sparse_cache *cache, struct sparse_band *victims)
+{
+	int r = 0;
+	while (victims != NULL) {
+		struct sparse_band *band = victims;
+		struct sparse_state *state = band->state;
+		LL_DELETE(victims, band);
+		int s = sparse_free_band(band);
+		r = r < 0 ? r : s;
+		pthread_mutex_lock(&cache->lock);
+		if (--state->lru.closing == 0) {
+			pthread_cond_broadcast(&state->lru.closed);
+		}
+		pthread_mutex_unlock(&cache->lock);
+	}
+	return r;
+}
+
+/* takes the count a band was closed with, or -1, locking lru.cache->lock required */
+inline static off_t sparse_take_counted(struct sparse_state *state, int id)
+{
+	struct sparse_counted_band *counted = NULL;
+	off_t allocated = -1;
+	HASH_FIND_INT(state->counted_ht, &id, counted);
+	if (counted != NULL) {
+		allocated = counted->allocated;
+		HASH_DEL(state->counted_ht, counted);
+		free(counted);
+	}
+	return allocated;
+}
+
+/* locking lru.cache->lock required, dead must not be busy */
+inline static void sparse_cancel_dead_band(struct sparse_state *state, struct sparse_dead_band *dead, struct sparse_band **victims)
+{
+	HASH_DEL(state->reclaim.dead_ht, dead);
+	if (dead->band != NULL) {
+		sparse_retire_band(dead->band, victims);
+	}
+	free(dead);
+}
+
+/* eopen, falling back to the page cache where direct I/O is not supported */
+inline static int sparse_open_band_fd(struct sparse_state *state, const char *path, int flags)
+{
+	uint64_t start = sparse_now();
+	int fd = eopen(path, flags, 0666);
+#ifdef O_DIRECT
+	if (fd == -EINVAL && (flags & O_DIRECT)) {
+		fd = eopen(path, flags & ~O_DIRECT, 0666);
+	}
+#elif defined(F_NOCACHE)
+	if (fd >= 0 && state->options.direct_io) {
+		fcntl(fd, F_NOCACHE, 1);
+	}
+#endif
+	sparse_record(state, SPARSE_LATENCY_sys_open, start);
+	sparse_count(state, SPARSE_STAT_band_opens, 1);
+	if (fd == -ENOENT) {
+		sparse_count(state, SPARSE_STAT_band_opens_missing, 1);
+	}
+	return fd;
+}
+
+/* locking lru.cache->lock required */
+inline static struct sparse_band *sparse_open_band(struct sparse_state *state, int id, int create, struct sparse_band **victims)
+{
+	/* initialize band */
+	struct sparse_band *band = calloc(1, sizeof(*band));
+	struct sparse_dead_band *dead = NULL;
+	band->index = id;
+	band->state = state;
+	HASH_FIND_INT(state->reclaim.dead_ht, &id, dead);
+	if (dead != NULL && !create) {
+		/* trimmed, the file is gone as far as readers are concerned */
+		band->fd = -ENOENT;
+	} else {
+		int flags = state->options.read_only ? O_RDONLY : O_RDWR;
+#ifdef O_DIRECT
+		if (state->options.direct_io) {
+			flags |= O_DIRECT;
+		}
+#endif
+		if (dead != NULL) {
+			/* recreated before the reclaimer got to it, reuse the file */
+			sparse_cancel_dead_band(state, dead, victims);
+			flags |= O_TRUNC;
+		}
+		UT_string *path; utstring_new(path);
+		utstring_printf(path, "%s/bands/%x", state->options.path, id);
+		band->fd = sparse_open_band_fd(state, utstring_body(path), flags);
+		int created = band->fd >= 0 && (flags & O_TRUNC);
+		if (create && band->fd == -ENOENT) {
+			/* exclusive create tells us whether the band is new */
+			band->fd = sparse_open_band_fd(state, utstring_body(path), flags | O_CREAT | O_EXCL);
+			created = band->fd >= 0;
+			if (band->fd == -EEXIST) {
+				band->fd = sparse_open_band_fd(state, utstring_body(path), flags);
+			}
+		}
+		utstring_free(path);
+		struct stat st;
+		if (created) {
+			/* counted by whatever writes it first */
+			sparse_count(state, SPARSE_STAT_band_creates, 1);
+			sparse_prealloc_band(state, band);
+			band->unsynced = 1;
+			state->sync.bands_dir = 1;
+			__atomic_add_fetch(&state->usage.bands, 1, __ATOMIC_RELAXED);
+		} else if (band->fd >= 0) {
+			/* counted by the scan at open, or when last closed */
+			off_t counted = sparse_take_counted(state, id);
+			band->allocated = fstat(band->fd, &st) == 0 ? (off_t)st.st_blocks * 512 : MAX(counted, 0);
+			if (counted >= 0) {
+				__atomic_add_fetch(&state->usage.allocated, band->allocated - counted, __ATOMIC_RELAXED);
+			}
+		}
+		if (state->options.mmap_bands && band->fd >= 0) {
+			sparse_map_band(state, band);
+		}
+	}
+	pthread_rwlock_init(&band->rwlock, NULL);
+	pthread_mutex_init(&band->rmw_lock, NULL);
+	pthread_mutex_init(&band->account_lock, NULL);
+	HASH_ADD_INT(state->lru.bands_ht, index, band);
+	DL_APPEND(state->lru.cache->bands_dl, band);
+	state->lru.cache->count++;
+	return band;
+}
+
+/* locking lru.cache->lock required */
 inline static int sparse_open_bands_count(struct sparse_state *state)
 {
 	return HASH_COUNT(state->lru.bands_ht);
@@ -181,160 +735,1440 @@ inline static int sparse_open_bands_count(struct sparse_state *state)
 
 inline static int sparse_close_bands(struct sparse_state *state)
 {
-	int r = 0;
-	pthread_mutex_lock(&state->lru.lock);
+	int m = 0;
+	struct sparse_band *band, *tmp, *victims = NULL;
+	pthread_mutex_lock(&state->lru.cache->lock);
 	while (sparse_open_bands_count(state) > 0) {
-		r = sparse_close_band(state, state->lru.bands_dl);
-		if (r < 0) {
-			break;
+		sparse_close_band(state, state->lru.bands_ht, &victims);
+	}
+	pthread_mutex_unlock(&state->lru.cache->lock);
+	/* nothing holds them any more, they are only this caller's now */
+	LL_FOREACH_SAFE(victims, band, tmp) {
+		if (band->map != NULL && __atomic_exchange_n(&band->dirty, 0, __ATOMIC_RELAXED)) {
+			if (msync(band->map, band->map_length, MS_SYNC)) {
+				m = -errno;
+			}
 		}
 	}
-	pthread_mutex_unlock(&state->lru.lock);
-	return r;
+	int r = sparse_free_bands(state->lru.cache, victims);
+	/* bands evicted by requests on other bundles may still be closing */
+	pthread_mutex_lock(&state->lru.cache->lock);
+	while (state->lru.closing > 0) {
+		pthread_cond_wait(&state->lru.closed, &state->lru.cache->lock);
+	}
+	pthread_mutex_unlock(&state->lru.cache->lock);
+	return m < 0 ? m : r;
+}
+
+/* keeps the band cached and open until sparse_release_band, locking lru.cache->lock required */
+inline static void sparse_hold_band(struct sparse_band *band)
+{
+	__atomic_add_fetch(&band->refs, 1, __ATOMIC_RELAXED);
+	pthread_rwlock_rdlock(&band->rwlock);
 }
 
 inline static struct sparse_band *sparse_get_band(struct sparse_state *state, int id, int create)
 {
-	struct sparse_band *band = NULL;
-	pthread_mutex_lock(&state->lru.lock);
+	struct sparse_band *band = NULL, *victims = NULL;
+	struct sparse_dead_band *dead = NULL;
+	pthread_mutex_lock(&state->lru.cache->lock);
+	if (create) {
+		/* the reclaimer is removing this band file, wait until it is gone */
+		while (1) {
+			HASH_FIND_INT(state->reclaim.dead_ht, &id, dead);
+			if (dead == NULL || !dead->busy) {
+				break;
+			}
+			pthread_cond_wait(&state->reclaim.done, &state->lru.cache->lock);
+		}
+	}
 	HASH_FIND_INT(state->lru.bands_ht, &id, band);
 	if (band != NULL) {
 		/* band obtained */
 		if (create && band->fd == -ENOENT) {
 			/* attempt to create band if not created yet. */
-			sparse_close_band(state, band);
-			band = sparse_open_band(state, id, create);
+			sparse_count(state, SPARSE_STAT_cache_misses, 1);
+			sparse_close_band(state, band, &victims);
+			band = sparse_open_band(state, id, create, &victims);
 		} else {
-			DL_DELETE(state->lru.bands_dl, band);
-			DL_APPEND(state->lru.bands_dl, band);
+			sparse_count(state, SPARSE_STAT_cache_hits, 1);
+			DL_DELETE(state->lru.cache->bands_dl, band);
+			DL_APPEND(state->lru.cache->bands_dl, band);
 		}
 	} else {
 		/* bind not found, time to open new bind. */
-		/* close band if length exceeded */
-		if (sparse_open_bands_count(state) >= state->options.max_open_bands) {
-			sparse_close_band(state, state->lru.bands_dl);
+		/* close band if length exceeded, whichever bundle it belongs to */
+		struct sparse_cache *cache = state->lru.cache;
+		sparse_count(state, SPARSE_STAT_cache_misses, 1);
+		while (cache->count >= cache->max_open_bands) {
+			/* held bands stay, the cache runs over until they are released */
+			struct sparse_band *victim = NULL;
+			DL_FOREACH(cache->bands_dl, victim) {
+				if (__atomic_load_n(&victim->refs, __ATOMIC_ACQUIRE) == 0) {
+					break;
+				}
+			}
+			if (victim == NULL) {
+				break;
+			}
+			sparse_count(state, SPARSE_STAT_cache_evictions, 1);
+			sparse_close_band(victim->state, victim, &victims);
 		}
-		band = sparse_open_band(state, id, create);	
+		band = sparse_open_band(state, id, create, &victims);	
 	}
-	pthread_rwlock_rdlock(&band->rwlock);
-	pthread_mutex_unlock(&state->lru.lock);
+	sparse_hold_band(band);
+	pthread_mutex_unlock(&state->lru.cache->lock);
+	sparse_free_bands(state->lru.cache, victims);
 	return band;
 }
 
+/*
+  takes a band about to be removed out of state->usage, whether it is
+  cached or not. locking lru.cache->lock required
+*/
+inline static void sparse_unaccount_band(struct sparse_state *state, struct sparse_band *band, int id)
+{
+	struct stat st;
+	char name[16];
+	if (band != NULL && band->fd >= 0) {
+		pthread_mutex_lock(&band->account_lock);
+		__atomic_sub_fetch(&state->usage.allocated, band->allocated, __ATOMIC_RELAXED);
+		/* writes still in flight must not bring it back */
+		band->allocated = -1;
+		pthread_mutex_unlock(&band->account_lock);
+		__atomic_sub_fetch(&state->usage.bands, 1, __ATOMIC_RELAXED);
+		return;
+	}
+	snprintf(name, sizeof(name), "%x", id);
+	if (fstatat(state->reclaim.bands_fd, name, &st, 0) == 0) {
+		off_t allocated = sparse_take_counted(state, id);
+		__atomic_sub_fetch(&state->usage.allocated, allocated >= 0 ? allocated : (off_t)st.st_blocks * 512, __ATOMIC_RELAXED);
+		__atomic_sub_fetch(&state->usage.bands, 1, __ATOMIC_RELAXED);
+	}
+}
+
+/*
+  marks the band as trimmed, reads return zeros from now on.
+  closing and unlinking the band file is left to the reclaimer.
+*/
 inline static int sparse_clear_band(struct sparse_state *state, int id)
 {
-	int r = 0;
 	struct sparse_band *band = NULL;
-	pthread_mutex_lock(&state->lru.lock);
+	struct sparse_dead_band *dead = NULL;
+	pthread_mutex_lock(&state->lru.cache->lock);
 	HASH_FIND_INT(state->lru.bands_ht, &id, band);
-	if (band == NULL) {
-		/* bind not found, time to open new bind. */
-		/* close band if length exceeded */
-		if (sparse_open_bands_count(state) >= state->options.max_open_bands) {
-			sparse_close_band(state, state->lru.bands_dl);
-		}
-		band = sparse_open_band(state, id, 0);
+	if (band != NULL && band->fd == -ENOENT) {
+		/* known not to exist, or already dead */
+		pthread_mutex_unlock(&state->lru.cache->lock);
+		return 0;
 	}
-	// removing the file
-	if (band->fd >= 0) {
-		if (close(band->fd)) {
-			r = -errno;
+	HASH_FIND_INT(state->reclaim.dead_ht, &id, dead);
+	if (dead == NULL) {
+		dead = calloc(1, sizeof(*dead));
+		dead->index = id;
+		HASH_ADD_INT(state->reclaim.dead_ht, index, dead);
+		sparse_unaccount_band(state, band, id);
+	}
+	if (band != NULL) {
+		/* dead bands are never cached with a valid fd, dead->band is free */
+		sparse_detach_band(state, band);
+		dead->band = band;
+	}
+	pthread_cond_signal(&state->reclaim.wake);
+	pthread_mutex_unlock(&state->lru.cache->lock);
+	return 0;
+}
+
+static void *sparse_reclaim_thread(void *arg)
+{
+	struct sparse_state *state = arg;
+	struct sparse_dead_band *batch[RECLAIM_BATCH_SIZE];
+	struct sparse_dead_band *dead, *tmp;
+	char name[16];
+	pthread_mutex_lock(&state->lru.cache->lock);
+	while (1) {
+		if (state->reclaim.dead_ht == NULL) {
+			if (state->reclaim.stop) {
+				break;
+			}
+			pthread_cond_wait(&state->reclaim.wake, &state->lru.cache->lock);
+			continue;
+		}
+		int count = 0;
+		HASH_ITER(hh, state->reclaim.dead_ht, dead, tmp) {
+			if (count == RECLAIM_BATCH_SIZE) {
+				break;
+			}
+			dead->busy = 1;
+			batch[count++] = dead;
 		}
-		if (!r) {
-			band->fd = -ENOENT;
-			UT_string *path; utstring_new(path);
-			utstring_printf(path, "%s/bands/%x", state->options.path, id);
-			if (unlink(utstring_body(path))) {
+		pthread_mutex_unlock(&state->lru.cache->lock);
+
+		int r = 0;
+		for (int i = 0; i < count; i++) {
+			/* unlink first, so closing the last fd releases the space */
+			snprintf(name, sizeof(name), "%x", batch[i]->index);
+			uint64_t start = sparse_now();
+			int unlinked = unlinkat(state->reclaim.bands_fd, name, 0) == 0;
+			sparse_record(state, SPARSE_LATENCY_sys_unlink, start);
+			if (unlinked) {
+				sparse_count(state, SPARSE_STAT_band_unlinks, 1);
+			} else if (errno != ENOENT) {
 				r = -errno;
 			}
-			utstring_free(path);
+			if (batch[i]->band != NULL) {
+				sparse_free_band(batch[i]->band);
+				batch[i]->band = NULL;
+			}
+		}
+		int s = sparse_sys_fsync(state, state->reclaim.bands_fd, 0);
+		r = r < 0 ? r : s;
+
+		pthread_mutex_lock(&state->lru.cache->lock);
+		if (r < 0) {
+			state->reclaim.error = r;
+		}
+		for (int i = 0; i < count; i++) {
+			HASH_DEL(state->reclaim.dead_ht, batch[i]);
+			free(batch[i]);
 		}
+		pthread_cond_broadcast(&state->reclaim.done);
 	}
-	pthread_mutex_unlock(&state->lru.lock);
+	pthread_mutex_unlock(&state->lru.cache->lock);
+	return NULL;
+}
+
+/* waits until all trimmed bands are removed, returns the first error seen */
+inline static int sparse_reclaim_drain(struct sparse_state *state)
+{
+	int r;
+	pthread_mutex_lock(&state->lru.cache->lock);
+	while (state->reclaim.dead_ht != NULL) {
+		pthread_cond_signal(&state->reclaim.wake);
+		pthread_cond_wait(&state->reclaim.done, &state->lru.cache->lock);
+	}
+	r = state->reclaim.error;
+	state->reclaim.error = 0;
+	pthread_mutex_unlock(&state->lru.cache->lock);
 	return r;
 }
 
 inline static void sparse_release_band(struct sparse_state *state, struct sparse_band *band)
 {
 	assert(band != NULL);
+	/* an eviction from here on waits for the rwlock, outside the cache lock */
+	__atomic_sub_fetch(&band->refs, 1, __ATOMIC_RELEASE);
 	pthread_rwlock_unlock(&band->rwlock);
 }
 
-inline static int sparse_rw(struct sparse_state* state, void *buf, size_t count, off_t offset, int write)
+/* band must be held */
+inline static void sparse_band_unsynced(struct sparse_band *band)
 {
-	int acc = 0;
-	int r = 0;
-	int band_index;
-	ssize_t band_offset, band_count;
-	struct sparse_band *band = NULL;
-	while (1) {
-		if (count == 0) {
-			break;
-		}
-		band_index = offset / state->info.band_size;
-		band_offset = MIN(offset % state->info.band_size, state->info.band_size);
+	if (!__atomic_load_n(&band->unsynced, __ATOMIC_ACQUIRE)) {
+		__atomic_store_n(&band->unsynced, 1, __ATOMIC_RELEASE);
+	}
+}
+
+/* band must be held, after the write has landed */
+inline static void sparse_band_written(struct sparse_state *state, struct sparse_band *band)
+{
+	/* counted first, so a sync that misses the count counts it again */
+	sparse_account_band(state, band);
+	sparse_band_unsynced(band);
+}
+
+/* band must be held, returns the file size after refreshing it */
+inline static off_t sparse_band_refresh_size(struct sparse_band *band)
+{
+	struct stat st;
+	if (fstat(band->fd, &st) == 0) {
+		__atomic_store_n(&band->size, st.st_size, __ATOMIC_RELAXED);
+	}
+	return __atomic_load_n(&band->size, __ATOMIC_RELAXED);
+}
+
+inline static struct sparse_buffer *sparse_buffer_get(struct sparse_state *state)
+{
+	struct sparse_buffer *buffer;
+	pthread_mutex_lock(&state->pool.lock);
+	buffer = state->pool.free;
+	if (buffer != NULL) {
+		state->pool.free = buffer->next;
+		state->pool.count--;
+	}
+	pthread_mutex_unlock(&state->pool.lock);
+	if (buffer != NULL) {
+		return buffer;
+	}
+
+	buffer = calloc(1, sizeof(*buffer));
+#ifdef MAP_HUGETLB
+	void *data = mmap(NULL, BUFFER_SIZE, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+	if (data != MAP_FAILED) {
+		buffer->data = data;
+		buffer->huge = 1;
+		return buffer;
+	}
+#endif
+	/* no reserved huge pages, transparent ones may still back it */
+	if (posix_memalign((void **)&buffer->data, BUFFER_SIZE, BUFFER_SIZE)) {
+		free(buffer);
+		return NULL;
+	}
+#ifdef MADV_HUGEPAGE
+	madvise(buffer->data, BUFFER_SIZE, MADV_HUGEPAGE);
+#endif
+	return buffer;
+}
+
+inline static void sparse_buffer_free(struct sparse_buffer *buffer)
+{
+	if (buffer->huge) {
+		munmap(buffer->data, BUFFER_SIZE);
+	} else {
+		free(buffer->data);
+	}
+	free(buffer);
+}
+
+inline static void sparse_buffer_put(struct sparse_state *state, struct sparse_buffer *buffer)
+{
+	pthread_mutex_lock(&state->pool.lock);
+	if (state->pool.count < BUFFER_POOL_MAX) {
+		buffer->next = state->pool.free;
+		state->pool.free = buffer;
+		state->pool.count++;
+		buffer = NULL;
+	}
+	pthread_mutex_unlock(&state->pool.lock);
+	if (buffer != NULL) {
+		sparse_buffer_free(buffer);
+	}
+}
+
+inline static int sparse_is_aligned(const void *buf, size_t count, off_t offset)
+{
+	return (((uintptr_t)buf | count | offset) & (DIRECT_ALIGN - 1)) == 0;
+}
+
+inline static off_t sparse_align_up(off_t offset)
+{
+	return (offset + DIRECT_ALIGN - 1) & ~(off_t)(DIRECT_ALIGN - 1);
+}
+
+/* direct_io, band must be held. reads a bounced chunk, returns the bytes consumed */
+static int sparse_band_read_unaligned(struct sparse_state *state, struct sparse_band *band, void *buf, size_t count, off_t offset)
+{
+	off_t start = offset & ~(off_t)(DIRECT_ALIGN - 1);
+	size_t span = MIN(sparse_align_up(offset + count) - start, BUFFER_SIZE);
+	size_t skip = offset - start;
+	count = MIN(count, span - skip);
+	struct sparse_buffer *bounce = sparse_buffer_get(state);
+	if (bounce == NULL) {
+		return -ENOMEM;
+	}
+	int r = sparse_sys_pread(state, band->fd, bounce->data, span, start);
+	if (r >= 0) {
+		size_t avail = r > skip ? MIN(count, r - skip) : 0;
+		memcpy(buf, bounce->data + skip, avail);
+		memset(buf + avail, 0, count - avail);
+		if (avail < count) {
+			sparse_count(state, SPARSE_STAT_short_reads, 1);
+			sparse_count(state, SPARSE_STAT_bytes_read_holes, count - avail);
+		}
+		r = count;
+	}
+	sparse_buffer_put(state, bounce);
+	return r;
+}
+
+/* reads one aligned block, zero filling past the end of the file */
+inline static int sparse_read_block(struct sparse_state *state, int fd, char *block, off_t offset)
+{
+	int r = sparse_sys_pread(state, fd, block, DIRECT_ALIGN, offset);
+	if (r >= 0) {
+		memset(block + r, 0, DIRECT_ALIGN - r);
+	}
+	return r;
+}
+
+/* direct_io, band must be held. read-modify-write of a bounced chunk, returns the bytes consumed */
+static int sparse_band_write_unaligned(struct sparse_state *state, struct sparse_band *band, const void *buf, size_t count, off_t offset)
+{
+	off_t start = offset & ~(off_t)(DIRECT_ALIGN - 1);
+	count = MIN(count, start + BUFFER_SIZE - offset);
+	off_t end = offset + count;
+	off_t aligned_end = sparse_align_up(end);
+	size_t span = aligned_end - start;
+	int r = 0;
+	struct sparse_buffer *bounce = sparse_buffer_get(state);
+	if (bounce == NULL) {
+		return -ENOMEM;
+	}
+	pthread_mutex_lock(&band->rmw_lock);
+	if (offset != start) {
+		r = sparse_read_block(state, band->fd, bounce->data, start);
+	}
+	if (r >= 0 && end != aligned_end && (span > DIRECT_ALIGN || offset == start)) {
+		r = sparse_read_block(state, band->fd, bounce->data + span - DIRECT_ALIGN, aligned_end - DIRECT_ALIGN);
+	}
+	if (r >= 0) {
+		memcpy(bounce->data + (offset - start), buf, count);
+		r = sparse_sys_pwrite(state, band->fd, bounce->data, span, start);
+		if (r >= 0) {
+			r = r == span ? count : -EIO;
+		}
+	}
+	pthread_mutex_unlock(&band->rmw_lock);
+	sparse_buffer_put(state, bounce);
+	return r;
+}
+
+/* band must be held, like epread but zero fills past the end of the band file */
+inline static int sparse_band_read(struct sparse_state *state, struct sparse_band *band, void *buf, size_t count, off_t offset)
+{
+	int r;
+	if (band->map != NULL) {
+		off_t size = __atomic_load_n(&band->size, __ATOMIC_RELAXED);
+		size_t avail = offset < size ? MIN(count, size - offset) : 0;
+		r = sparse_map_copy(buf, band->map + offset, avail);
+		if (r == 0) {
+			memset(buf + avail, 0, count - avail);
+			if (avail < count) {
+				sparse_count(state, SPARSE_STAT_short_reads, 1);
+				sparse_count(state, SPARSE_STAT_bytes_read_holes, count - avail);
+			}
+			return count;
+		}
+		/* truncated under us */
+		sparse_band_refresh_size(band);
+	}
+	if (state->options.direct_io && band->fd >= 0 && !sparse_is_aligned(buf, count, offset)) {
+		return sparse_band_read_unaligned(state, band, buf, count, offset);
+	}
+	r = sparse_sys_pread(state, band->fd, buf, count, offset);
+	if (r == 0 || r == -ENOENT) {
+		/* a partial read comes back here for the rest, and counts once */
+		if (r == 0) {
+			sparse_count(state, SPARSE_STAT_short_reads, 1);
+		}
+		sparse_count(state, SPARSE_STAT_bytes_read_holes, count);
+		memset(buf, 0, count);
+		r = count;
+	}
+	return r;
+}
+
+/* band must be held */
+inline static int sparse_band_write(struct sparse_state *state, struct sparse_band *band, void *buf, size_t count, off_t offset)
+{
+	if (state->options.prealloc == SPARSE_PREALLOC_KEEP_SIZE) {
+		sparse_prealloc_write(state, band, offset, count);
+	}
+	if (band->map != NULL) {
+		off_t size = __atomic_load_n(&band->size, __ATOMIC_RELAXED);
+		if (offset + count <= size && sparse_map_copy(band->map + offset, buf, count) == 0) {
+			/* the space faulting pages in takes is counted at the next sync */
+			__atomic_store_n(&band->dirty, 1, __ATOMIC_RELAXED);
+			sparse_band_unsynced(band);
+			return count;
+		}
+	}
+	int r;
+	if (state->options.direct_io && band->fd >= 0 && !sparse_is_aligned(buf, count, offset)) {
+		r = sparse_band_write_unaligned(state, band, buf, count, offset);
+	} else {
+		r = sparse_sys_pwrite(state, band->fd, buf, count, offset);
+	}
+	if (r > 0 && band->map != NULL) {
+		/* the file grew, the mapping is backed up to the new end */
+		off_t size = __atomic_load_n(&band->size, __ATOMIC_RELAXED);
+		while (size < offset + r &&
+			!__atomic_compare_exchange_n(&band->size, &size, offset + r, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+	}
+	if (r > 0) {
+		sparse_band_written(state, band);
+	}
+	return r;
+}
+
+/* false only if the band is known not to exist without taking any lock */
+inline static int sparse_band_may_exist(struct sparse_state *state, int id)
+{
+	return state->band_map == NULL || (id < state->band_map_count && state->band_map[id]);
+}
+
+inline static int sparse_rw(struct sparse_state* state, void *buf, size_t count, off_t offset, int write)
+{
+	int acc = 0;
+	int r = 0;
+	int band_index;
+	ssize_t band_offset, band_count;
+	struct sparse_band *band = NULL;
+	if (write && state->options.read_only) {
+		return -EROFS;
+	}
+	while (1) {
+		if (count == 0) {
+			break;
+		}
+		band_index = offset / state->info.band_size;
+		band_offset = MIN(offset % state->info.band_size, state->info.band_size);
 		band_count = MIN(state->info.band_size-band_offset, count);
+		if (!sparse_band_may_exist(state, band_index)) {
+			/* lock free path for holes in read only bundles */
+			sparse_count(state, SPARSE_STAT_bytes_read_holes, band_count);
+			memset(buf+acc, 0, band_count);
+			acc += band_count;
+			count -= band_count;
+			offset += band_count;
+			continue;
+		}
 		band = sparse_get_band(state, band_index, write);
 		if (write) {
-			r = epwrite(band->fd, buf+acc, band_count, band_offset);
+			r = sparse_band_write(state, band, buf+acc, band_count, band_offset);
 		} else {
-			r = epread(band->fd, buf+acc, band_count, band_offset);
-			if (r == 0 || r == -ENOENT) {
-				memset(buf+acc, 0, band_count);
-				r = band_count;
+			r = sparse_band_read(state, band, buf+acc, band_count, band_offset);
+		}
+		sparse_release_band(state, band);
+		if (r < 0) {
+			return r;
+		}
+		acc += r;
+		count -= r;
+		offset += r;
+	}
+	return acc;
+}
+
+int sparse_pread(struct sparse_state *state, char *buf, size_t size, off_t offset)
+{
+	uint64_t start = sparse_now();
+	int r = sparse_rw(state, (void *)buf, size, offset, 0);
+	sparse_record(state, SPARSE_LATENCY_pread, start);
+	sparse_count(state, SPARSE_STAT_reads, 1);
+	if (r > 0) {
+		sparse_count(state, SPARSE_STAT_bytes_read, r);
+	}
+	return r;
+}
+
+int sparse_pwrite(struct sparse_state *state, const char *buf, size_t size, off_t offset)
+{
+	uint64_t start = sparse_now();
+	int r = sparse_rw(state, (void *)buf, size, offset, 1);
+	sparse_record(state, SPARSE_LATENCY_pwrite, start);
+	sparse_count(state, SPARSE_STAT_writes, 1);
+	if (r > 0) {
+		sparse_count(state, SPARSE_STAT_bytes_written, r);
+	}
+	return r;
+}
+
+void sparse_put_segments(struct sparse_state *state, struct sparse_segment *segments, int count)
+{
+	for (int i = 0; i < count; i++) {
+		if (segments[i].band != NULL) {
+			if (segments[i].write) {
+				sparse_band_written(state, segments[i].band);
+			}
+			sparse_release_band(state, segments[i].band);
+		}
+	}
+}
+
+/*
+  maps a range onto band files for zero copy I/O (splice), holding the
+  bands until sparse_put_segments. reads get a zero segment for whatever
+  lies past the end of a band file. returns the number of segments used,
+  -E2BIG if count is too small, or -ENOTSUP when bands are mapped or
+  opened O_DIRECT and must go through sparse_pread/sparse_pwrite.
+*/
+int sparse_get_segments(struct sparse_state *state, size_t size, off_t offset, int write, struct sparse_segment *segments, int count)
+{
+	int n = 0, r = 0;
+	struct stat st;
+	if (state->options.mmap_bands || state->options.direct_io) {
+		return -ENOTSUP;
+	}
+	if (write && state->options.read_only) {
+		return -EROFS;
+	}
+	while (size > 0) {
+		int band_index = offset / state->info.band_size;
+		off_t band_offset = offset % state->info.band_size;
+		size_t band_count = MIN(state->info.band_size - band_offset, size);
+		struct sparse_band *band = NULL;
+		if (n == count) {
+			r = -E2BIG;
+			break;
+		}
+		if (write || sparse_band_may_exist(state, band_index)) {
+			band = sparse_get_band(state, band_index, write);
+		}
+		struct sparse_segment *segment = &segments[n++];
+		segment->band = band;
+		segment->write = write;
+		segment->fd = -1;
+		segment->offset = band_offset;
+		segment->size = band_count;
+		if (band != NULL && band->fd >= 0) {
+			if (write) {
+				if (state->options.prealloc == SPARSE_PREALLOC_KEEP_SIZE) {
+					sparse_prealloc_write(state, band, band_offset, band_count);
+				}
+				segment->fd = band->fd;
+			} else if (fstat(band->fd, &st)) {
+				r = -errno;
+				break;
+			} else if (band_offset < st.st_size) {
+				segment->fd = band->fd;
+				segment->size = MIN(band_count, st.st_size - band_offset);
+				if (segment->size < band_count) {
+					/* splicing past the end reads nothing, not zeros */
+					if (n == count) {
+						r = -E2BIG;
+						break;
+					}
+					segments[n].band = NULL;
+					segments[n].write = 0;
+					segments[n].fd = -1;
+					segments[n].offset = band_offset + segment->size;
+					segments[n].size = band_count - segment->size;
+					n++;
+				}
+			}
+		} else if (band != NULL && (write || band->fd != -ENOENT)) {
+			r = band->fd;
+			break;
+		}
+		offset += band_count;
+		size -= band_count;
+	}
+	if (r < 0) {
+		sparse_put_segments(state, segments, n);
+		return r;
+	}
+	/* counted as the reads and writes they stand in for */
+	sparse_count(state, write ? SPARSE_STAT_writes : SPARSE_STAT_reads, 1);
+	for (int i = 0; i < n; i++) {
+		sparse_count(state, write ? SPARSE_STAT_bytes_written : SPARSE_STAT_bytes_read, segments[i].size);
+		if (!write && segments[i].fd < 0) {
+			sparse_count(state, SPARSE_STAT_bytes_read_holes, segments[i].size);
+		}
+	}
+	return n;
+}
+
+/*
+  opens a band file of its own for I/O outside the library, such as FUSE
+  passthrough. the file is extended to the band length so that it reads
+  like the image does, writing creates the band. returns the fd, which the
+  caller closes, -ENOENT for a band that does not exist, or -ENODATA when
+  a read only band file is too short to be handed out.
+*/
+int sparse_open_band_file(struct sparse_state *state, int id, int write)
+{
+	int fd;
+	struct stat st;
+	off_t length = sparse_band_length(state, id);
+	if (write && state->options.read_only) {
+		return -EROFS;
+	}
+	if (id < 0 || length <= 0) {
+		return -EINVAL;
+	}
+	if (!write && !sparse_band_may_exist(state, id)) {
+		return -ENOENT;
+	}
+	/* holding the band keeps the reclaimer away from the file */
+	struct sparse_band *band = sparse_get_band(state, id, write);
+	fd = band->fd;
+	if (fd >= 0) {
+		UT_string *path; utstring_new(path);
+		utstring_printf(path, "%s/bands/%x", state->options.path, id);
+		fd = eopen(utstring_body(path), write ? O_RDWR : O_RDONLY, 0);
+		utstring_free(path);
+	}
+	if (fd >= 0 && fstat(fd, &st)) {
+		int r = -errno;
+		close(fd);
+		fd = r;
+	} else if (fd >= 0 && st.st_size < length) {
+		if (!write) {
+			close(fd);
+			fd = -ENODATA;
+		} else if (ftruncate(fd, length)) {
+			int r = -errno;
+			close(fd);
+			fd = r;
+		} else {
+			sparse_band_written(state, band);
+			if (band->map != NULL) {
+				/* the mapping is only trusted below the known size */
+				sparse_band_refresh_size(band);
+			}
+		}
+	}
+	sparse_release_band(state, band);
+	return fd;
+}
+
+int sparse_trim(struct sparse_state *state, size_t size, off_t offset)
+{
+	int r = 0;
+	if (state->options.read_only) {
+		return -EROFS;
+	}
+	uint64_t start = sparse_now();
+	sparse_count(state, SPARSE_STAT_trims, 1);
+	sparse_count(state, SPARSE_STAT_bytes_trimmed, size);
+	int start_band = (offset + state->info.band_size - 1) / state->info.band_size;
+	int end_band = (offset + size) / state->info.band_size;
+	for (int i = start_band; i < end_band; i++) {
+		r = sparse_clear_band(state, i);
+		if (r < 0) {
+			break;
+		}
+	}
+	sparse_record(state, SPARSE_LATENCY_trim, start);
+	return r;
+}
+
+/* 1 if the band file exists, 0 if not, or negative errno. opens nothing */
+static int sparse_band_exists(struct sparse_state *state, int id)
+{
+	struct sparse_band *band = NULL;
+	struct sparse_dead_band *dead = NULL;
+	struct stat st;
+	char name[16];
+	if (!sparse_band_may_exist(state, id)) {
+		return 0;
+	}
+	pthread_mutex_lock(&state->lru.cache->lock);
+	HASH_FIND_INT(state->lru.bands_ht, &id, band);
+	HASH_FIND_INT(state->reclaim.dead_ht, &id, dead);
+	int cached = dead != NULL || band != NULL;
+	int r = 0;
+	if (dead == NULL && band != NULL && band->fd != -ENOENT) {
+		r = band->fd >= 0 ? 1 : band->fd;
+	}
+	pthread_mutex_unlock(&state->lru.cache->lock);
+	if (cached) {
+		return r;
+	}
+	snprintf(name, sizeof(name), "%x", id);
+	if (fstatat(state->reclaim.bands_fd, name, &st, 0)) {
+		return errno == ENOENT ? 0 : -errno;
+	}
+	return 1;
+}
+
+/* finds the extent at offset within a band, up to limit */
+static int sparse_band_extent(struct sparse_state *state, int id, off_t offset, off_t limit, off_t *length, int *flags)
+{
+	int r = sparse_band_exists(state, id);
+	*flags = SPARSE_EXTENT_HOLE;
+	*length = limit - offset;
+	if (r <= 0) {
+		return r;
+	}
+	struct sparse_band *band = sparse_get_band(state, id, 0);
+	struct stat st;
+	if (band->fd < 0) {
+		r = band->fd == -ENOENT ? 0 : band->fd;
+	} else if (fstat(band->fd, &st)) {
+		r = -errno;
+	} else if (offset < st.st_size) {
+		off_t data = offset, hole = st.st_size;
+#ifdef SEEK_DATA
+		data = lseek(band->fd, offset, SEEK_DATA);
+		if (data < 0) {
+			/* ENXIO: only a hole up to the end of the file */
+			data = errno == ENXIO ? limit : offset;
+		}
+		if (data == offset) {
+			hole = lseek(band->fd, offset, SEEK_HOLE);
+			if (hole < 0) {
+				hole = st.st_size;
+			}
+		}
+#endif
+		if (data > offset) {
+			*length = MIN(data, limit) - offset;
+		} else {
+			*flags = 0;
+			*length = MIN(hole, limit) - offset;
+		}
+	}
+	sparse_release_band(state, band);
+	return r;
+}
+
+int sparse_extents(struct sparse_state *state, size_t size, off_t offset, sparse_extent_fn fn, void *opaque)
+{
+	int r = 0;
+	off_t end = MIN(offset + size, sparse_get_size(state));
+	off_t start = offset, length = 0;
+	int flags = 0;
+	sparse_count(state, SPARSE_STAT_extents, 1);
+	while (offset < end) {
+		int band_index = offset / state->info.band_size;
+		off_t band_start = (off_t)band_index * state->info.band_size;
+		off_t band_length;
+		int band_flags;
+		r = sparse_band_extent(state, band_index, offset - band_start,
+			MIN(end - band_start, state->info.band_size), &band_length, &band_flags);
+		if (r < 0) {
+			return r;
+		}
+		if (length > 0 && band_flags != flags) {
+			/* report what has been merged so far */
+			r = fn(opaque, start, length, flags);
+			if (r) {
+				return r;
+			}
+			length = 0;
+		}
+		if (length == 0) {
+			start = offset;
+			flags = band_flags;
+		}
+		length += band_length;
+		offset += band_length;
+	}
+	if (length > 0) {
+		r = fn(opaque, start, length, flags);
+	}
+	return r;
+}
+
+static char sparse_zeros[ZERO_BUFFER_SIZE] __attribute__((aligned(DIRECT_ALIGN)));
+
+/* zeros a range of a band without deallocating it, band must be held */
+static int sparse_band_write_zeros(struct sparse_state *state, struct sparse_band *band, off_t offset, size_t count, int flags)
+{
+#if defined(HAVE_FALLOCATE) && defined(FALLOC_FL_ZERO_RANGE)
+	if (fallocate(band->fd, FALLOC_FL_ZERO_RANGE, offset, count) == 0) {
+		if (band->map != NULL) {
+			sparse_band_refresh_size(band);
+		}
+		sparse_band_written(state, band);
+		return 0;
+	}
+#endif
+	if (flags & SPARSE_ZERO_FAST) {
+		return -ENOTSUP;
+	}
+	while (count > 0) {
+		int r = sparse_band_write(state, band, sparse_zeros, MIN(count, ZERO_BUFFER_SIZE), offset);
+		if (r < 0) {
+			return r;
+		}
+		offset += r;
+		count -= r;
+	}
+	return 0;
+}
+
+/* zeros part of a band, punching a hole where allowed. returns 0 or -errno */
+static int sparse_band_zero(struct sparse_state *state, int id, off_t offset, size_t count, int flags)
+{
+	int r = 0;
+	struct stat st;
+	struct sparse_band *band;
+	if (flags & SPARSE_ZERO_MAY_TRIM) {
+		r = sparse_band_exists(state, id);
+		if (r <= 0) {
+			/* nothing there, already zeros */
+			return r;
+		}
+		r = 0;
+		band = sparse_get_band(state, id, 0);
+		if (band->fd < 0) {
+			r = band->fd == -ENOENT ? 0 : band->fd;
+		} else if (fstat(band->fd, &st)) {
+			r = -errno;
+		} else if (offset < st.st_size) {
+			count = MIN(count, st.st_size - offset);
+#if defined(HAVE_FALLOCATE) && defined(FALLOC_FL_PUNCH_HOLE)
+			if (fallocate(band->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, count) == 0) {
+				sparse_band_written(state, band);
+				sparse_release_band(state, band);
+				return 0;
+			}
+#endif
+			r = sparse_band_write_zeros(state, band, offset, count, flags);
+		}
+	} else {
+		band = sparse_get_band(state, id, 1);
+		r = band->fd < 0 ? band->fd : sparse_band_write_zeros(state, band, offset, count, flags);
+	}
+	sparse_release_band(state, band);
+	return r;
+}
+
+int sparse_zero(struct sparse_state *state, size_t size, off_t offset, int flags)
+{
+	int r = 0;
+	if (state->options.read_only) {
+		return -EROFS;
+	}
+	sparse_count(state, SPARSE_STAT_zeros, 1);
+	sparse_count(state, SPARSE_STAT_bytes_zeroed, size);
+	while (size > 0) {
+		int band_index = offset / state->info.band_size;
+		off_t band_offset = offset % state->info.band_size;
+		off_t band_length = sparse_band_length(state, band_index);
+		size_t band_count = MIN(state->info.band_size - band_offset, size);
+		if ((flags & SPARSE_ZERO_MAY_TRIM) && !(flags & SPARSE_ZERO_KEEP_BANDS) &&
+			band_offset == 0 && band_count >= band_length) {
+			/* the whole band goes */
+			r = sparse_clear_band(state, band_index);
+		} else {
+			r = sparse_band_zero(state, band_index, band_offset, band_count, flags);
+		}
+		if (r < 0) {
+			break;
+		}
+		offset += band_count;
+		size -= band_count;
+	}
+	return r;
+}
+
+/* starts reading a band range in ahead of use, band must be held */
+inline static void sparse_band_prefetch(struct sparse_band *band, off_t offset, size_t count)
+{
+	if (band->map != NULL) {
+		off_t size = __atomic_load_n(&band->size, __ATOMIC_RELAXED);
+		off_t start = offset & ~(off_t) (sysconf(_SC_PAGESIZE) - 1);
+		off_t end = MIN(offset + (off_t) count, size);
+		if (start < end) {
+			posix_madvise(band->map + start, end - start, POSIX_MADV_WILLNEED);
+		}
+		return;
+	}
+#if defined(HAVE_POSIX_FADVISE) && defined(POSIX_FADV_WILLNEED)
+	/* asynchronous, only queues the reads */
+	posix_fadvise(band->fd, offset, count, POSIX_FADV_WILLNEED);
+#endif
+}
+
+int sparse_prefetch(struct sparse_state *state, size_t size, off_t offset)
+{
+	int r = 0;
+	sparse_count(state, SPARSE_STAT_prefetches, 1);
+	while (size > 0) {
+		int band_index = offset / state->info.band_size;
+		off_t band_offset = offset % state->info.band_size;
+		size_t band_count = MIN(state->info.band_size - band_offset, size);
+		r = sparse_band_exists(state, band_index);
+		if (r < 0) {
+			break;
+		}
+		if (r > 0) {
+			/* opening the band already saves the open on the read */
+			struct sparse_band *band = sparse_get_band(state, band_index, 0);
+			if (band->fd >= 0 && !state->options.direct_io) {
+				sparse_band_prefetch(band, band_offset, band_count);
+			}
+			sparse_release_band(state, band);
+		}
+		offset += band_count;
+		size -= band_count;
+	}
+	return r < 0 ? r : 0;
+}
+
+/* band must be held */
+inline static int sparse_band_sync(struct sparse_band *band, int datasync)
+{
+	if (band->map != NULL && __atomic_exchange_n(&band->dirty, 0, __ATOMIC_RELAXED)) {
+		if (msync(band->map, band->map_length, MS_SYNC)) {
+			return -errno;
+		}
+	}
+	return sparse_sys_fsync(band->state, band->fd, datasync);
+}
+
+inline static int sparse_fsync_path(struct sparse_state *state, const char *path, int datasync)
+{
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		return -errno;
+	}
+	int r = sparse_sys_fsync(state, fd, datasync);
+	close(fd);
+	return r;
+}
+
+/* syncs an evicted band, and counts it again once writeback is done with it */
+inline static int sparse_fsync_band_path(struct sparse_state *state, int id, int datasync)
+{
+	struct sparse_counted_band *counted = NULL;
+	struct stat st;
+	UT_string *path; utstring_new(path);
+	utstring_printf(path, "%s/bands/%x", state->options.path, id);
+	int fd = open(utstring_body(path), O_RDONLY);
+	utstring_free(path);
+	if (fd < 0) {
+		return -errno;
+	}
+	int r = sparse_sys_fsync(state, fd, datasync);
+	if (r == 0 && fstat(fd, &st) == 0 && st.st_nlink > 0) {
+		pthread_mutex_lock(&state->lru.cache->lock);
+		HASH_FIND_INT(state->counted_ht, &id, counted);
+		if (counted != NULL) {
+			__atomic_add_fetch(&state->usage.allocated, (off_t)st.st_blocks * 512 - counted->allocated, __ATOMIC_RELAXED);
+			counted->allocated = (off_t)st.st_blocks * 512;
+		}
+		pthread_mutex_unlock(&state->lru.cache->lock);
+	}
+	close(fd);
+	return r;
+}
+
+static int sparse_sync_bands(struct sparse_state *state, int datasync)
+{
+	int r = sparse_reclaim_drain(state);
+	int count = 0, bands_dir;
+	struct sparse_band *band, *tmp;
+	struct sparse_unsynced_band *evicted, *failed = NULL, *unsynced, *next, *found;
+	if (state->options.read_only) {
+		return r;
+	}
+	pthread_mutex_lock(&state->lru.cache->lock);
+	struct sparse_band **bands = malloc((HASH_COUNT(state->lru.bands_ht) + 1) * sizeof(*bands));
+	HASH_ITER(hh, state->lru.bands_ht, band, tmp) {
+		if (band->fd >= 0 && __atomic_exchange_n(&band->unsynced, 0, __ATOMIC_ACQ_REL)) {
+			sparse_hold_band(band);
+			bands[count++] = band;
+		}
+	}
+	evicted = state->sync.evicted_ht;
+	state->sync.evicted_ht = NULL;
+	bands_dir = state->sync.bands_dir;
+	state->sync.bands_dir = 0;
+	pthread_mutex_unlock(&state->lru.cache->lock);
+
+	for (int i = 0; i < count; i++) {
+		int s = sparse_band_sync(bands[i], datasync);
+		sparse_count(state, SPARSE_STAT_band_syncs, 1);
+		r = r < 0 ? r : s;
+		if (s == 0) {
+			/* settled by writeback, count it again */
+			sparse_account_band(state, bands[i]);
+		} else {
+			/* the next sync tries again */
+			sparse_band_unsynced(bands[i]);
+		}
+		sparse_release_band(state, bands[i]);
+	}
+	free(bands);
+	HASH_ITER(hh, evicted, unsynced, next) {
+		int s = sparse_fsync_band_path(state, unsynced->index, datasync);
+		sparse_count(state, SPARSE_STAT_band_syncs, 1);
+		/* a band trimmed since has nothing left to sync */
+		r = r < 0 || s == -ENOENT ? r : s;
+		HASH_DEL(evicted, unsynced);
+		if (s < 0 && s != -ENOENT) {
+			HASH_ADD_INT(failed, index, unsynced);
+		} else {
+			free(unsynced);
+		}
+	}
+	if (bands_dir) {
+		int s = sparse_sys_fsync(state, state->reclaim.bands_fd, 0);
+		r = r < 0 ? r : s;
+		bands_dir = s < 0;
+	}
+	if (failed != NULL || bands_dir) {
+		/* what did not make it stays for the next sync */
+		pthread_mutex_lock(&state->lru.cache->lock);
+		HASH_ITER(hh, failed, unsynced, next) {
+			HASH_DEL(failed, unsynced);
+			HASH_FIND_INT(state->sync.evicted_ht, &unsynced->index, found);
+			if (found == NULL) {
+				HASH_ADD_INT(state->sync.evicted_ht, index, unsynced);
+			} else {
+				free(unsynced);
+			}
+		}
+		state->sync.bands_dir |= bands_dir;
+		pthread_mutex_unlock(&state->lru.cache->lock);
+	}
+	return r;
+}
+
+/*
+  makes the writes that completed so far durable, syncing only the bands
+  written since the last sync. with datasync, metadata not needed to read
+  the data back is left alone.
+*/
+int sparse_sync(struct sparse_state *state, int datasync)
+{
+	uint64_t start = sparse_now();
+	int r = sparse_sync_bands(state, datasync);
+	sparse_record(state, SPARSE_LATENCY_flush, start);
+	sparse_count(state, SPARSE_STAT_syncs, 1);
+	return r;
+}
+
+int sparse_flush(struct sparse_state *state)
+{
+	return sparse_sync(state, 0);
+}
+
+static int sparse_execute(struct sparse_state *state, struct sparse_request *request)
+{
+	int r;
+	switch (request->op) {
+		case SPARSE_OP_READ:
+			r = sparse_pread(state, request->buf, request->size, request->offset);
+			break;
+		case SPARSE_OP_WRITE:
+			r = sparse_pwrite(state, request->buf, request->size, request->offset);
+			break;
+		case SPARSE_OP_FLUSH:
+			r = sparse_flush(state);
+			break;
+		case SPARSE_OP_TRIM:
+			r = sparse_trim(state, request->size, request->offset);
+			break;
+		case SPARSE_OP_ZERO:
+			r = sparse_zero(state, request->size, request->offset, request->flags);
+			break;
+		case SPARSE_OP_CACHE:
+			r = sparse_prefetch(state, request->size, request->offset);
+			break;
+		case SPARSE_OP_EXTENTS:
+			r = sparse_extents(state, request->size, request->offset, request->extent, request->opaque);
+			break;
+		default:
+			r = -EINVAL;
+			break;
+	}
+	if (r >= 0 && request->fua) {
+		int f = sparse_sync(state, 1);
+		r = f < 0 ? f : r;
+	}
+	return r;
+}
+
+static void *sparse_worker_thread(void *arg)
+{
+	struct sparse_state *state = arg;
+	pthread_mutex_lock(&state->queue.lock);
+	while (1) {
+		struct sparse_request *request = state->queue.head;
+		if (request == NULL) {
+			/* queued requests are still served after stop */
+			if (state->queue.stop) {
+				break;
 			}
+			pthread_cond_wait(&state->queue.wake, &state->queue.lock);
+			continue;
 		}
-		sparse_release_band(state, band);
-		if (r < 0) {
-			return r;
+		state->queue.head = request->next;
+		if (state->queue.head == NULL) {
+			state->queue.tail = NULL;
 		}
-		acc += r;
-		count -= r;
-		offset += r;
+		pthread_mutex_unlock(&state->queue.lock);
+		request->result = sparse_execute(state, request);
+		request->complete(request);
+		pthread_mutex_lock(&state->queue.lock);
 	}
-	return acc;
+	pthread_mutex_unlock(&state->queue.lock);
+	return NULL;
 }
 
-int sparse_pread(struct sparse_state *state, char *buf, size_t size, off_t offset)
+int sparse_submit(struct sparse_state *state, struct sparse_request *request)
 {
-	return sparse_rw(state, (void *)buf, size, offset, 0);
+	if (state->queue.count == 0) {
+		request->result = sparse_execute(state, request);
+		request->complete(request);
+		return 0;
+	}
+	request->next = NULL;
+	pthread_mutex_lock(&state->queue.lock);
+	if (state->queue.tail != NULL) {
+		state->queue.tail->next = request;
+	} else {
+		state->queue.head = request;
+	}
+	state->queue.tail = request;
+	pthread_cond_signal(&state->queue.wake);
+	pthread_mutex_unlock(&state->queue.lock);
+	return 0;
 }
 
-int sparse_pwrite(struct sparse_state *state, const char *buf, size_t size, off_t offset)
+/* serves what is still queued, then stops the workers */
+inline static void sparse_stop_workers(struct sparse_state *state)
 {
-	return sparse_rw(state, (void *)buf, size, offset, 1);
+	pthread_mutex_lock(&state->queue.lock);
+	state->queue.stop = 1;
+	pthread_cond_broadcast(&state->queue.wake);
+	pthread_mutex_unlock(&state->queue.lock);
+	for (int i = 0; i < state->queue.count; i++) {
+		pthread_join(state->queue.threads[i], NULL);
+	}
+	free(state->queue.threads);
+	state->queue.threads = NULL;
+	state->queue.count = 0;
 }
 
-int sparse_trim(struct sparse_state *state, size_t size, off_t offset)
+int sparse_parse_prealloc(const char *name, enum sparse_prealloc *prealloc)
 {
-	int r = 0;
-	int start_band = (offset + state->info.band_size - 1) / state->info.band_size;
-	int end_band = (offset + size) / state->info.band_size;
-	for (int i = start_band; i < end_band; i++) {
-		r = sparse_clear_band(state, i);
-		if (r < 0) {
-			break;
+	static const char *names[] = {
+		[SPARSE_PREALLOC_NONE] = "none",
+		[SPARSE_PREALLOC_FULL] = "full",
+		[SPARSE_PREALLOC_KEEP_SIZE] = "keep-size",
+		[SPARSE_PREALLOC_TRUNCATE] = "truncate",
+	};
+	for (int i = 0; i < ARRAY_SIZE(names); i++) {
+		if (strcmp(name, names[i]) == 0) {
+			*prealloc = i;
+			return 0;
 		}
 	}
-	return r;
+	return 1;
 }
 
-int sparse_flush(struct sparse_state *state)
+int sparse_parse_access(const char *name, enum sparse_access *access)
 {
-	return sparse_close_bands(state);
+	static const char *names[] = {
+		[SPARSE_ACCESS_NORMAL] = "normal",
+		[SPARSE_ACCESS_SEQUENTIAL] = "sequential",
+		[SPARSE_ACCESS_RANDOM] = "random",
+	};
+	for (int i = 0; i < ARRAY_SIZE(names); i++) {
+		if (strcmp(name, names[i]) == 0) {
+			*access = i;
+			return 0;
+		}
+	}
+	return 1;
 }
 
 size_t sparse_get_size(struct sparse_state* state) {
-	return state->info.size;
+	return __atomic_load_n(&state->info.size, __ATOMIC_RELAXED);
+}
+
+size_t sparse_get_band_size(struct sparse_state* state) {
+	return state->info.band_size;
+}
+
+int sparse_get_usage(struct sparse_state *state, struct sparse_usage *usage)
+{
+	/* the two counters are not a snapshot */
+	usage->allocated = __atomic_load_n(&state->usage.allocated, __ATOMIC_RELAXED);
+	usage->bands = __atomic_load_n(&state->usage.bands, __ATOMIC_RELAXED);
+	return 0;
+}
+
+int sparse_get_stats(struct sparse_state *state, struct sparse_stats *stats)
+{
+	/* each counter is exact, the set is not a snapshot */
+	memset(stats, 0, sizeof(*stats));
+	for (int i = 0; i < STATS_SLOTS; i++) {
+#define SPARSE_STAT_SUM(name, description) \
+		stats->name += __atomic_load_n(&state->stats[i].counters[SPARSE_STAT_##name], __ATOMIC_RELAXED);
+		SPARSE_STATS(SPARSE_STAT_SUM)
+#undef SPARSE_STAT_SUM
+	}
+	return 0;
+}
+
+inline static void sparse_merge_histogram(struct sparse_histogram *merged, struct sparse_histogram *histogram)
+{
+	merged->count += __atomic_load_n(&histogram->count, __ATOMIC_RELAXED);
+	merged->sum += __atomic_load_n(&histogram->sum, __ATOMIC_RELAXED);
+	for (int i = 0; i < SPARSE_HISTOGRAM_BUCKETS; i++) {
+		merged->buckets[i] += __atomic_load_n(&histogram->buckets[i], __ATOMIC_RELAXED);
+	}
+}
+
+int sparse_get_latencies(struct sparse_state *state, struct sparse_latencies *latencies)
+{
+	memset(latencies, 0, sizeof(*latencies));
+	for (int i = 0; i < STATS_SLOTS; i++) {
+#define SPARSE_LATENCY_MERGE(name, description) \
+		sparse_merge_histogram(&latencies->name, &state->stats[i].latencies[SPARSE_LATENCY_##name]);
+		SPARSE_LATENCIES(SPARSE_LATENCY_MERGE)
+#undef SPARSE_LATENCY_MERGE
+	}
+	return 0;
+}
+
+uint64_t sparse_histogram_bucket_min(int bucket)
+{
+	if (bucket < 4) {
+		return bucket;
+	}
+	return (uint64_t)(4 + bucket % 4) << (bucket / 4 - 1);
+}
+
+inline static void sparse_dump_histogram(FILE *f, const char *name, const struct sparse_histogram *histogram, int last)
+{
+	const char *sep = "";
+	fprintf(f, "\"%s\":{\"count\":%llu,\"sum_ns\":%llu,\"buckets\":[", name,
+		(unsigned long long)histogram->count, (unsigned long long)histogram->sum);
+	for (int i = 0; i < SPARSE_HISTOGRAM_BUCKETS; i++) {
+		if (histogram->buckets[i]) {
+			fprintf(f, "%s[%llu,%llu]", sep, (unsigned long long)sparse_histogram_bucket_min(i),
+				(unsigned long long)histogram->buckets[i]);
+			sep = ",";
+		}
+	}
+	fprintf(f, "]}%s", last ? "" : ",");
+}
+
+/* buckets are listed as [smallest latency in ns, count] */
+int sparse_dump_stats(struct sparse_state *state, FILE *f)
+{
+	struct sparse_stats stats;
+	struct sparse_latencies *latencies = malloc(sizeof(*latencies));
+	if (latencies == NULL) {
+		return -ENOMEM;
+	}
+	sparse_get_stats(state, &stats);
+	sparse_get_latencies(state, latencies);
+	fprintf(f, "{\"counters\":{");
+#define SPARSE_STAT_DUMP(name, description) \
+	fprintf(f, "\"%s\":%llu%s", #name, (unsigned long long)stats.name, \
+		SPARSE_STAT_##name == SPARSE_STAT_COUNT - 1 ? "" : ",");
+	SPARSE_STATS(SPARSE_STAT_DUMP)
+#undef SPARSE_STAT_DUMP
+	fprintf(f, "},\"latencies\":{");
+#define SPARSE_LATENCY_DUMP(name, description) \
+	sparse_dump_histogram(f, #name, &latencies->name, SPARSE_LATENCY_##name == SPARSE_LATENCY_COUNT - 1);
+	SPARSE_LATENCIES(SPARSE_LATENCY_DUMP)
+#undef SPARSE_LATENCY_DUMP
+	fprintf(f, "}}\n");
+	free(latencies);
+	return ferror(f) ? -EIO : 0;
+}
+
+/* starts a sample line, up to the value */
+static void sparse_prometheus_sample(FILE *f, const char *metric, const char *suffix, const char *bundle, const char *le)
+{
+	fprintf(f, "sparsebundle_%s%s", metric, suffix);
+	if (bundle == NULL && le == NULL) {
+		fputc(' ', f);
+		return;
+	}
+	fputc('{', f);
+	if (bundle != NULL) {
+		fputs("bundle=\"", f);
+		for (const char *c = bundle; *c != '\0'; c++) {
+			if (*c == '\n') {
+				fputs("\\n", f);
+				continue;
+			}
+			if (*c == '\\' || *c == '"') {
+				fputc('\\', f);
+			}
+			fputc(*c, f);
+		}
+		fputc('"', f);
+	}
+	if (le != NULL) {
+		fprintf(f, "%sle=\"%s\"", bundle != NULL ? "," : "", le);
+	}
+	fputs("} ", f);
+}
+
+/* histogram at offset in each of the latencies */
+static void sparse_prometheus_histogram(FILE *f, const char *metric, const char *description,
+	const struct sparse_latencies *latencies, size_t offset, const char **names, int count)
+{
+	fprintf(f, "# HELP sparsebundle_%s_seconds %s\n", metric, description);
+	fprintf(f, "# TYPE sparsebundle_%s_seconds histogram\n", metric);
+	for (int i = 0; i < count; i++) {
+		const struct sparse_histogram *histogram = (const void *)((const char *)&latencies[i] + offset);
+		const char *name = names != NULL ? names[i] : NULL;
+		uint64_t cumulative = 0;
+		int bucket = 0;
+		char le[32];
+		for (int bound = PROMETHEUS_FIRST_BUCKET; bound < SPARSE_HISTOGRAM_BUCKETS; bound += 4) {
+			for (; bucket < bound; bucket++) {
+				cumulative += histogram->buckets[bucket];
+			}
+			snprintf(le, sizeof(le), "%.9g", sparse_histogram_bucket_min(bound) / 1e9);
+			sparse_prometheus_sample(f, metric, "_seconds_bucket", name, le);
+			fprintf(f, "%llu\n", (unsigned long long)cumulative);
+		}
+		for (; bucket < SPARSE_HISTOGRAM_BUCKETS; bucket++) {
+			cumulative += histogram->buckets[bucket];
+		}
+		/* from the buckets, the count may have moved on since they were read */
+		sparse_prometheus_sample(f, metric, "_seconds_bucket", name, "+Inf");
+		fprintf(f, "%llu\n", (unsigned long long)cumulative);
+		sparse_prometheus_sample(f, metric, "_seconds_sum", name, NULL);
+		fprintf(f, "%.9f\n", histogram->sum / 1e9);
+		sparse_prometheus_sample(f, metric, "_seconds_count", name, NULL);
+		fprintf(f, "%llu\n", (unsigned long long)cumulative);
+	}
+}
+
+int sparse_dump_prometheus(FILE *f, struct sparse_state **states, const char **names, int count)
+{
+	struct sparse_stats *stats = calloc(count + 1, sizeof(*stats));
+	struct sparse_latencies *latencies = calloc(count + 1, sizeof(*latencies));
+	struct sparse_usage *usage = calloc(count + 1, sizeof(*usage));
+	if (stats == NULL || latencies == NULL || usage == NULL) {
+		free(stats);
+		free(latencies);
+		free(usage);
+		return -ENOMEM;
+	}
+	for (int i = 0; i < count; i++) {
+		sparse_get_stats(states[i], &stats[i]);
+		sparse_get_latencies(states[i], &latencies[i]);
+		sparse_get_usage(states[i], &usage[i]);
+	}
+#define SPARSE_STAT_PROMETHEUS(metric, description) \
+	fprintf(f, "# HELP sparsebundle_%s_total %s\n", #metric, description); \
+	fprintf(f, "# TYPE sparsebundle_%s_total counter\n", #metric); \
+	for (int i = 0; i < count; i++) { \
+		sparse_prometheus_sample(f, #metric, "_total", names != NULL ? names[i] : NULL, NULL); \
+		fprintf(f, "%llu\n", (unsigned long long)stats[i].metric); \
+	}
+	SPARSE_STATS(SPARSE_STAT_PROMETHEUS)
+#undef SPARSE_STAT_PROMETHEUS
+#define SPARSE_GAUGE_PROMETHEUS(metric, description, value) \
+	fprintf(f, "# HELP sparsebundle_%s %s\n", metric, description); \
+	fprintf(f, "# TYPE sparsebundle_%s gauge\n", metric); \
+	for (int i = 0; i < count; i++) { \
+		sparse_prometheus_sample(f, metric, "", names != NULL ? names[i] : NULL, NULL); \
+		fprintf(f, "%llu\n", (unsigned long long)(value)); \
+	}
+	SPARSE_GAUGE_PROMETHEUS("size_bytes", "image size", sparse_get_size(states[i]))
+	SPARSE_GAUGE_PROMETHEUS("allocated_bytes", "space taken by the band files", usage[i].allocated)
+	SPARSE_GAUGE_PROMETHEUS("band_files", "band files", usage[i].bands)
+#undef SPARSE_GAUGE_PROMETHEUS
+#define SPARSE_LATENCY_PROMETHEUS(metric, description) \
+	sparse_prometheus_histogram(f, #metric, description, latencies, \
+		offsetof(struct sparse_latencies, metric), names, count);
+	SPARSE_LATENCIES(SPARSE_LATENCY_PROMETHEUS)
+#undef SPARSE_LATENCY_PROMETHEUS
+	free(stats);
+	free(latencies);
+	free(usage);
+	return ferror(f) ? -EIO : 0;
 }
 
+/* why the last sparse_open on this thread failed */
+static __thread const char *sparse_open_error = NULL;
+
 const char *sparse_get_error(struct sparse_state* state) {
-	return state->error;
+	return state != NULL ? state->error : sparse_open_error;
 }
 
-static int sparse_parse_info_plist(struct sparse_state* state, yxml_t *parser, FILE* f)
+static int sparse_parse_info_plist(const char **error, struct sparse_info *info, yxml_t *parser, FILE* f)
 {
-	struct sparse_info* info = &state->info;
 	UT_string *cur_key = NULL;
 	UT_string *cur_value = NULL;
 	int ret = 0;
@@ -342,10 +2176,13 @@ static int sparse_parse_info_plist(struct sparse_state* state, yxml_t *parser, F
 	int depth = 0, match = 1;
 	const char *dict_path[] = {"plist", "dict"};
 	char c;
+	long pos = -1;
+	info->size_start = -1;
 	while (fread(&c, 1, 1, f)) {
+		pos++;
 		yxml_ret_t r = yxml_parse(parser, c);
 		if (r < 0) {
-			state->error = "error while parsing plist";
+			*error = "error while parsing plist";
 			ret = 1;
 			break;
 		}
@@ -369,7 +2206,7 @@ static int sparse_parse_info_plist(struct sparse_state* state, yxml_t *parser, F
 					if (strcmp(utstring_body(cur_key), "band-size") == 0) {
 						info->band_size = atoi(utstring_body(cur_value));
 					} else if (strcmp(utstring_body(cur_key), "size") == 0) {
-						info->size = atoi(utstring_body(cur_value));
+						info->size = strtoull(utstring_body(cur_value), NULL, 10);
 					} else if (strcmp(utstring_body(cur_key), "bundle-backingstore-version") == 0) {
 						info->bundle_backingstore_version = atoi(utstring_body(cur_value));
 					}
@@ -384,6 +2221,12 @@ static int sparse_parse_info_plist(struct sparse_state* state, yxml_t *parser, F
 			case YXML_CONTENT:
 				if (in_value) {
 					utstring_bincpy(cur_value, parser->data, strlen(parser->data));
+					if (cur_key && strcmp(utstring_body(cur_key), "size") == 0) {
+						if (info->size_start < 0) {
+							info->size_start = pos;
+						}
+						info->size_end = pos + 1;
+					}
 				} else if (in_key) {
 					utstring_bincpy(cur_key, parser->data, strlen(parser->data));
 				}
@@ -399,31 +2242,296 @@ static int sparse_parse_info_plist(struct sparse_state* state, yxml_t *parser, F
 		utstring_free(cur_value);
 	}
 	if (info->bundle_backingstore_version != 1) {
-		state->error = "unsupported bundle-backingstore-version";
+		*error = "unsupported bundle-backingstore-version";
 		ret = 1;
 	}
 	if (info->band_size <= 0) {
-		state->error = "unable to obtain a valid band-size";
+		*error = "unable to obtain a valid band-size";
 		ret = 1;
 	}
-	if (info->size <= 0) {
-		state->error = "unable to obtain a valid size";
+	if (info->size == 0) {
+		*error = "unable to obtain a valid size";
 		ret = 1;
 	}
 	return ret;
 }
 
-int sparse_open(struct sparse_state **state_ptr, const struct sparse_options *options)
+/* reads the Info.plist of the bundle at path, returns 0 or a negative errno */
+static int sparse_read_info(const char *path, struct sparse_info *info, const char **error)
 {
-	struct sparse_state *state = calloc(1, sizeof(struct sparse_state));
-	*state_ptr = state;
+	UT_string *plist_path = NULL; utstring_new(plist_path);
+	utstring_printf(plist_path, "%s/%s", path, "Info.plist");
+	FILE* plist_file = fopen(utstring_body(plist_path), "r");
+	utstring_free(plist_path);
+	if (plist_file == NULL) {
+		*error = "unable to open Info.plist";
+		return -errno;
+	}
+
+	yxml_t *yxml_parser = malloc(sizeof(yxml_t) + XML_BUFFER_SIZE);
+	yxml_init(yxml_parser, yxml_parser+1, XML_BUFFER_SIZE);
+	int plist_ret = sparse_parse_info_plist(error, info, yxml_parser, plist_file);
+	fclose(plist_file);
+	free(yxml_parser);
+	return plist_ret ? -EINVAL : 0;
+}
+
+/* without opening the bundle, for callers that only need to stat it */
+int sparse_read_size(const char *path, uint64_t *size)
+{
+	struct sparse_info info = {0};
+	const char *error;
+	int r = sparse_read_info(path, &info, &error);
+	if (r == 0) {
+		*size = info.size;
+	}
+	return r;
+}
+
+/* calls fn for every band file found in the bands directory */
+static int sparse_scan_bands(struct sparse_state *state, void (*fn)(struct sparse_state *, int, void *), void *arg)
+{
+	int fd = openat(state->reclaim.bands_fd, ".", O_RDONLY | O_DIRECTORY);
+	DIR *dir = fd >= 0 ? fdopendir(fd) : NULL;
+	if (dir == NULL) {
+		int r = -errno;
+		if (fd >= 0) {
+			close(fd);
+		}
+		return r;
+	}
+	struct dirent *ent;
+	while ((ent = readdir(dir)) != NULL) {
+		char *end;
+		long id = strtol(ent->d_name, &end, 16);
+		if (end == ent->d_name || *end != '\0' || id < 0 || id > INT_MAX) {
+			continue;
+		}
+		fn(state, id, arg);
+	}
+	closedir(dir);
+	return 0;
+}
+
+static void sparse_clear_band_beyond(struct sparse_state *state, int id, void *arg)
+{
+	if (id >= *(int *)arg) {
+		sparse_clear_band(state, id);
+	}
+}
+
+/* drops all data at and after end */
+static int sparse_clear_bands_beyond(struct sparse_state *state, uint64_t end)
+{
+	int r = 0;
+	int first = (end + state->info.band_size - 1) / state->info.band_size;
+	off_t length = end % state->info.band_size;
+	if (length) {
+		struct stat st;
+		struct sparse_band *band = sparse_get_band(state, end / state->info.band_size, 0);
+		if (band->fd >= 0 && fstat(band->fd, &st) == 0 && st.st_size > length) {
+			if (ftruncate(band->fd, length)) {
+				r = -errno;
+			} else {
+				sparse_band_written(state, band);
+				if (band->map != NULL) {
+					sparse_band_refresh_size(band);
+				}
+			}
+		}
+		sparse_release_band(state, band);
+	}
+	if (!r) {
+		r = sparse_scan_bands(state, sparse_clear_band_beyond, &first);
+	}
+	return r;
+}
+
+/* replaces the size in a plist with a temp file, fsync and rename */
+static int sparse_rewrite_plist(struct sparse_state *state, const char *name, uint64_t size)
+{
+	int r = 0;
+	char chunk[XML_BUFFER_SIZE];
+	size_t n;
+	struct stat st;
+	UT_string *path; utstring_new(path);
+	UT_string *tmp_path; utstring_new(tmp_path);
+	UT_string *content; utstring_new(content);
+	utstring_printf(path, "%s/%s", state->options.path, name);
+	utstring_printf(tmp_path, "%s/.%s.tmp", state->options.path, name);
+
+	FILE *f = fopen(utstring_body(path), "r");
+	if (f == NULL) {
+		r = -errno;
+		goto out;
+	}
+	if (fstat(fileno(f), &st)) {
+		r = -errno;
+		fclose(f);
+		goto out;
+	}
+	while ((n = fread(chunk, 1, sizeof(chunk), f)) > 0) {
+		utstring_bincpy(content, chunk, n);
+	}
+	fclose(f);
+
+	struct sparse_info info = {0};
+	yxml_t *yxml_parser = malloc(sizeof(yxml_t) + XML_BUFFER_SIZE);
+	yxml_init(yxml_parser, yxml_parser+1, XML_BUFFER_SIZE);
+	f = fmemopen(utstring_body(content), utstring_len(content), "r");
+	int plist_ret = f == NULL || sparse_parse_info_plist(&state->error, &info, yxml_parser, f);
+	if (f != NULL) {
+		fclose(f);
+	}
+	free(yxml_parser);
+	if (plist_ret || info.size_start < 0) {
+		r = -EINVAL;
+		goto out;
+	}
+
+	int fd = open(utstring_body(tmp_path), O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if (fd < 0) {
+		r = -errno;
+		goto out;
+	}
+	/* the rewritten file replaces the original, it keeps its permissions */
+	if (fchmod(fd, st.st_mode & 07777)) {
+		r = -errno;
+		close(fd);
+		unlink(utstring_body(tmp_path));
+		goto out;
+	}
+	f = fdopen(fd, "w");
+	if (f == NULL) {
+		r = -errno;
+		close(fd);
+		unlink(utstring_body(tmp_path));
+		goto out;
+	}
+	fwrite(utstring_body(content), 1, info.size_start, f);
+	fprintf(f, "%llu", (unsigned long long)size);
+	fwrite(utstring_body(content) + info.size_end, 1, utstring_len(content) - info.size_end, f);
+	if (fflush(f) || fsync(fd)) {
+		r = -errno;
+	}
+	if (fclose(f) && !r) {
+		r = -errno;
+	}
+	if (!r && rename(utstring_body(tmp_path), utstring_body(path))) {
+		r = -errno;
+	}
+	if (r) {
+		unlink(utstring_body(tmp_path));
+	}
+out:
+	utstring_free(content);
+	utstring_free(tmp_path);
+	utstring_free(path);
+	return r;
+}
+
+int sparse_resize(struct sparse_state *state, size_t size)
+{
+	int r = 0;
+	if (size == 0) {
+		return -EINVAL;
+	}
+	if (state->options.read_only) {
+		return -EROFS;
+	}
+	pthread_mutex_lock(&state->resize_lock);
+	uint64_t old_size = sparse_get_size(state);
+	if (size > old_size) {
+		/* whatever lies past the old end must read back as zeros */
+		r = sparse_clear_bands_beyond(state, old_size);
+	}
+	if (!r) {
+		r = sparse_rewrite_plist(state, "Info.plist", size);
+	}
+	UT_string *path; utstring_new(path);
+	utstring_printf(path, "%s/Info.bckup", state->options.path);
+	if (!r && access(utstring_body(path), F_OK) == 0) {
+		r = sparse_rewrite_plist(state, "Info.bckup", size);
+	}
+	utstring_free(path);
+	if (!r) {
+		r = sparse_fsync_path(state, state->options.path, 0);
+	}
+	int resized = !r;
+	if (resized) {
+		__atomic_store_n(&state->info.size, size, __ATOMIC_RELAXED);
+		if (size < old_size) {
+			r = sparse_clear_bands_beyond(state, size);
+		}
+	}
+	pthread_mutex_unlock(&state->resize_lock);
+	if (resized && state->options.resized != NULL) {
+		state->options.resized(state, old_size, size);
+	}
+	return r;
+}
 
+int sparse_cache_create(struct sparse_cache **cache_ptr, int max_open_bands)
+{
+	struct sparse_cache *cache = calloc(1, sizeof(struct sparse_cache));
+	if (cache == NULL) {
+		return -ENOMEM;
+	}
+	cache->max_open_bands = MAX(max_open_bands, 1);
+	cache->refs = 1;
+	pthread_mutex_init(&cache->lock, NULL);
+	*cache_ptr = cache;
+	return 0;
+}
+
+inline static void sparse_cache_acquire(struct sparse_cache *cache)
+{
+	pthread_mutex_lock(&cache->lock);
+	cache->refs++;
+	pthread_mutex_unlock(&cache->lock);
+}
+
+void sparse_cache_release(struct sparse_cache **cache_ptr)
+{
+	struct sparse_cache *cache = *cache_ptr;
+	pthread_mutex_lock(&cache->lock);
+	int refs = --cache->refs;
+	pthread_mutex_unlock(&cache->lock);
+	if (refs == 0) {
+		/* every bundle using it is closed, no bands are left */
+		pthread_mutex_destroy(&cache->lock);
+		free(cache);
+	}
+	*cache_ptr = NULL;
+}
+
+/* counts a band found at open, and notes it in the band map when read only */
+static void sparse_scan_band(struct sparse_state *state, int id, void *arg)
+{
+	struct stat st;
+	char name[16];
+	snprintf(name, sizeof(name), "%x", id);
+	if (fstatat(state->reclaim.bands_fd, name, &st, 0) == 0 && S_ISREG(st.st_mode)) {
+		state->usage.allocated += (off_t)st.st_blocks * 512;
+		state->usage.bands++;
+	}
+	if (id < state->band_map_count) {
+		state->band_map[id] = 1;
+	}
+}
+
+static int sparse_open_state(struct sparse_state *state, const struct sparse_options *options)
+{
 	memcpy(&state->options, options, sizeof(struct sparse_options));
 	state->options.max_open_bands = MAX(state->options.max_open_bands, 1);
 	if (state->options.path == NULL) {
 		state->error = "invalid path";
 		return 1;
 	}
+	if (state->options.mmap_bands && state->options.direct_io) {
+		state->error = "mmap and direct I/O cannot be combined";
+		return 1;
+	}
 
 	struct stat bands_stat;
 	UT_string *bands_path = NULL; utstring_new(bands_path);
@@ -439,34 +2547,141 @@ int sparse_open(struct sparse_state **state_ptr, const struct sparse_options *op
 		return 1;
 	}
 
-	UT_string *plist_path = NULL; utstring_new(plist_path);
-	utstring_printf(plist_path, "%s/%s", state->options.path, "Info.plist");
-	FILE* plist_file = fopen(utstring_body(plist_path), "r");
-	if (plist_file == NULL) {
-		utstring_free(plist_path);
-		state->error = "unable to open Info.plist";
+	if (sparse_read_info(state->options.path, &state->info, &state->error)) {
 		return 1;
 	}
 
-	yxml_t *yxml_parser = malloc(sizeof(yxml_t) + XML_BUFFER_SIZE);;
-	yxml_init(yxml_parser, yxml_parser+1, XML_BUFFER_SIZE);
-	int plist_ret = sparse_parse_info_plist(state, yxml_parser, plist_file);
-	fclose(plist_file);
-	free(yxml_parser);
-	utstring_free(plist_path);
-	if (plist_ret) {
+	utstring_new(bands_path);
+	utstring_printf(bands_path, "%s/%s", state->options.path, "bands");
+	state->reclaim.bands_fd = open(utstring_body(bands_path), O_RDONLY | O_DIRECTORY);
+	utstring_free(bands_path);
+	if (state->reclaim.bands_fd < 0) {
+		state->error = "unable to open bands";
+		return 1;
+	}
+
+	if (state->options.cache != NULL) {
+		sparse_cache_acquire(state->options.cache);
+		state->lru.cache = state->options.cache;
+	} else if (sparse_cache_create(&state->lru.cache, state->options.max_open_bands)) {
+		state->error = "unable to create band cache";
 		return 1;
 	}
+	pthread_mutex_init(&state->resize_lock, NULL);
+	pthread_mutex_init(&state->pool.lock, NULL);
+	pthread_mutex_init(&state->queue.lock, NULL);
+	pthread_cond_init(&state->queue.wake, NULL);
+	pthread_cond_init(&state->reclaim.wake, NULL);
+	pthread_cond_init(&state->reclaim.done, NULL);
+	pthread_cond_init(&state->lru.closed, NULL);
 
-	pthread_mutex_init(&state->lru.lock, NULL);
+	if (state->options.mmap_bands) {
+		sparse_sigbus_acquire();
+	}
+
+	if (state->options.read_only) {
+		state->band_map_count = (state->info.size + state->info.band_size - 1) / state->info.band_size;
+		state->band_map = calloc(state->band_map_count, 1);
+	}
+	if (sparse_scan_bands(state, sparse_scan_band, NULL)) {
+		state->error = "unable to list bands";
+		return 1;
+	}
+	if (!state->options.read_only) {
+		if (pthread_create(&state->reclaim.thread, NULL, sparse_reclaim_thread, state)) {
+			state->error = "unable to start reclaimer";
+			return 1;
+		}
+		state->reclaim.started = 1;
+	}
+
+	if (state->options.async_threads > 0) {
+		state->queue.threads = calloc(state->options.async_threads, sizeof(pthread_t));
+		for (; state->queue.count < state->options.async_threads; state->queue.count++) {
+			if (pthread_create(&state->queue.threads[state->queue.count], NULL, sparse_worker_thread, state)) {
+				state->error = "unable to start workers";
+				return 1;
+			}
+		}
+	}
+
+	return 0;
+}
 
+/*
+  on failure *state_ptr is NULL, whatever was set up is released and
+  sparse_get_error(NULL) tells why
+*/
+int sparse_open(struct sparse_state **state_ptr, const struct sparse_options *options)
+{
+	/* aligned, the counter slots must not share cache lines */
+	struct sparse_state *state = aligned_alloc(_Alignof(struct sparse_state), sizeof(struct sparse_state));
+	*state_ptr = NULL;
+	if (state == NULL) {
+		sparse_open_error = "out of memory";
+		return 1;
+	}
+	memset(state, 0, sizeof(struct sparse_state));
+	state->reclaim.bands_fd = -1;
+	if (sparse_open_state(state, options)) {
+		sparse_open_error = state->error;
+		sparse_close(&state);
+		return 1;
+	}
+	*state_ptr = state;
 	return 0;
 }
 
+/* also undoes a sparse_open that failed part way */
 int sparse_close(struct sparse_state **state_ptr)
 {
 	struct sparse_state *state = *state_ptr;
-	sparse_flush(state);
+	/* the locks and the queue are set up along with the cache */
+	int initialized = state->lru.cache != NULL;
+	if (initialized) {
+		sparse_stop_workers(state);
+		sparse_reclaim_drain(state);
+		sparse_close_bands(state);
+		if (state->options.mmap_bands) {
+			sparse_sigbus_release();
+		}
+	}
+	if (state->reclaim.started) {
+		pthread_mutex_lock(&state->lru.cache->lock);
+		state->reclaim.stop = 1;
+		pthread_cond_signal(&state->reclaim.wake);
+		pthread_mutex_unlock(&state->lru.cache->lock);
+		pthread_join(state->reclaim.thread, NULL);
+	}
+	if (state->reclaim.bands_fd >= 0) {
+		close(state->reclaim.bands_fd);
+	}
+	struct sparse_unsynced_band *unsynced, *next;
+	HASH_ITER(hh, state->sync.evicted_ht, unsynced, next) {
+		HASH_DEL(state->sync.evicted_ht, unsynced);
+		free(unsynced);
+	}
+	struct sparse_counted_band *counted, *tmp;
+	HASH_ITER(hh, state->counted_ht, counted, tmp) {
+		HASH_DEL(state->counted_ht, counted);
+		free(counted);
+	}
+	free(state->band_map);
+	if (initialized) {
+		pthread_cond_destroy(&state->reclaim.wake);
+		pthread_cond_destroy(&state->reclaim.done);
+		pthread_cond_destroy(&state->lru.closed);
+		sparse_cache_release(&state->lru.cache);
+		pthread_mutex_destroy(&state->resize_lock);
+		while (state->pool.free != NULL) {
+			struct sparse_buffer *buffer = state->pool.free;
+			state->pool.free = buffer->next;
+			sparse_buffer_free(buffer);
+		}
+		pthread_mutex_destroy(&state->pool.lock);
+		pthread_cond_destroy(&state->queue.wake);
+		pthread_mutex_destroy(&state->queue.lock);
+	}
 	free(state);
 	*state_ptr = NULL;
 	return 0;
@@ -0,0 +1,62 @@
+/*
+  creates and removes the scratch bundles the tests run against
+*/
+#include <dirent.h>
+#include <limits.h>
+#include <stdio.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "bundle.h"
+
+int bundle_create(const char *path, int band_size, uint64_t size)
+{
+	char name[PATH_MAX];
+	snprintf(name, sizeof(name), "%s/bands", path);
+	if (mkdir(path, 0777) || mkdir(name, 0777)) {
+		return 1;
+	}
+	snprintf(name, sizeof(name), "%s/Info.plist", path);
+	FILE *plist = fopen(name, "w");
+	if (plist == NULL) {
+		return 1;
+	}
+	fprintf(plist,
+		"<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+		"<plist version=\"1.0\">\n"
+		"<dict>\n"
+		"\t<key>band-size</key>\n"
+		"\t<integer>%d</integer>\n"
+		"\t<key>bundle-backingstore-version</key>\n"
+		"\t<integer>1</integer>\n"
+		"\t<key>diskimage-bundle-type</key>\n"
+		"\t<string>com.apple.diskimage.sparsebundle</string>\n"
+		"\t<key>size</key>\n"
+		"\t<integer>%llu</integer>\n"
+		"</dict>\n"
+		"</plist>\n",
+		band_size, (unsigned long long)size);
+	return fclose(plist) != 0;
+}
+
+void bundle_remove(const char *path)
+{
+	char name[PATH_MAX];
+	snprintf(name, sizeof(name), "%s/bands", path);
+	DIR *dir = opendir(name);
+	struct dirent *entry;
+	while (dir != NULL && (entry = readdir(dir)) != NULL) {
+		if (entry->d_name[0] != '.') {
+			snprintf(name, sizeof(name), "%s/bands/%s", path, entry->d_name);
+			unlink(name);
+		}
+	}
+	if (dir != NULL) {
+		closedir(dir);
+	}
+	snprintf(name, sizeof(name), "%s/bands", path);
+	rmdir(name);
+	snprintf(name, sizeof(name), "%s/Info.plist", path);
+	unlink(name);
+	rmdir(path);
+}
@@ -0,0 +1,11 @@
+#ifndef TESTS_BUNDLE_H
+#define TESTS_BUNDLE_H
+
+#include <stdint.h>
+
+/* writes an empty bundle with an Info.plist, returns 0 or 1 */
+int bundle_create(const char *path, int band_size, uint64_t size);
+/* removes a bundle made by bundle_create, with whatever bands it got */
+void bundle_remove(const char *path);
+
+#endif
@@ -0,0 +1,344 @@
+/*
+  runs sparsebundle-nbd on a unix socket and talks to it as a client:
+  negotiates structured replies and base:allocation, writes across bands
+  and reads it back, and asks for block status over data and holes.
+  a client that never reads its replies must not hold up another one,
+  a hang here fails through alarm.
+*/
+#include <errno.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "protocol.h"
+#include "bundle.h"
+
+#define BAND_SIZE (256 << 10)
+#define IMAGE_SIZE (4 << 20)
+#define DATA_SIZE (64 << 10)
+/* starts in band 0 and ends in band 1 */
+#define DATA_OFFSET (BAND_SIZE - 4096)
+#define SLOW_READ_SIZE (1 << 20)
+#define SLOW_READS 256
+
+inline static uint32_t get32(const unsigned char *p)
+{
+	return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+inline static uint64_t get64(const unsigned char *p)
+{
+	return (uint64_t)get32(p) << 32 | get32(p + 4);
+}
+
+inline static unsigned char *put16(unsigned char *p, uint16_t v)
+{
+	p[0] = v >> 8;
+	p[1] = v;
+	return p + 2;
+}
+
+inline static unsigned char *put32(unsigned char *p, uint32_t v)
+{
+	return put16(put16(p, v >> 16), v);
+}
+
+inline static unsigned char *put64(unsigned char *p, uint64_t v)
+{
+	return put32(put32(p, v >> 32), v);
+}
+
+static int nbd_send(int fd, const void *buf, size_t size)
+{
+	const char *p = buf;
+	while (size > 0) {
+		ssize_t n = write(fd, p, size);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			return 1;
+		}
+		p += n;
+		size -= n;
+	}
+	return 0;
+}
+
+static int nbd_recv(int fd, void *buf, size_t size)
+{
+	char *p = buf;
+	while (size > 0) {
+		ssize_t n = read(fd, p, size);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			return 1;
+		}
+		p += n;
+		size -= n;
+	}
+	return 0;
+}
+
+/* the server may not be listening yet */
+static int nbd_connect(const char *path)
+{
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+	for (int i = 0; i < 200; i++) {
+		int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+		if (fd >= 0 && connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0) {
+			return fd;
+		}
+		if (fd >= 0) {
+			close(fd);
+		}
+		usleep(50000);
+	}
+	fprintf(stderr, "nbd: cannot connect to %s\n", path);
+	return -1;
+}
+
+static int nbd_option(int fd, uint32_t option, const unsigned char *data, uint32_t length)
+{
+	unsigned char header[16];
+	put32(put32(put64(header, NBD_IHAVEOPT), option), length);
+	return nbd_send(fd, header, sizeof(header)) || nbd_send(fd, data, length);
+}
+
+/* reads one option reply, its data goes to buf */
+static int nbd_option_reply(int fd, uint32_t option, uint32_t *type, unsigned char *buf, uint32_t size)
+{
+	unsigned char header[20];
+	if (nbd_recv(fd, header, sizeof(header)) || get64(header) != NBD_REP_MAGIC ||
+		get32(header + 8) != option || get32(header + 16) > size) {
+		return 1;
+	}
+	*type = get32(header + 12);
+	return nbd_recv(fd, buf, get32(header + 16));
+}
+
+/* fixed newstyle with structured replies and base:allocation, then GO */
+static int nbd_handshake(int fd)
+{
+	unsigned char buf[64], *p;
+	uint32_t type;
+	if (nbd_recv(fd, buf, 18) || get64(buf) != NBD_MAGIC || get64(buf + 8) != NBD_IHAVEOPT ||
+		!(buf[17] & NBD_FLAG_FIXED_NEWSTYLE)) {
+		fprintf(stderr, "nbd: no fixed newstyle greeting\n");
+		return 1;
+	}
+	put32(buf, NBD_FLAG_C_FIXED_NEWSTYLE | NBD_FLAG_C_NO_ZEROES);
+	if (nbd_send(fd, buf, 4)) {
+		return 1;
+	}
+
+	if (nbd_option(fd, NBD_OPT_STRUCTURED_REPLY, NULL, 0) ||
+		nbd_option_reply(fd, NBD_OPT_STRUCTURED_REPLY, &type, buf, sizeof(buf)) || type != NBD_REP_ACK) {
+		fprintf(stderr, "nbd: structured replies refused\n");
+		return 1;
+	}
+
+	/* the default export, one query */
+	p = put32(put32(buf, 0), 1);
+	p = put32(p, strlen("base:allocation"));
+	memcpy(p, "base:allocation", strlen("base:allocation"));
+	p += strlen("base:allocation");
+	if (nbd_option(fd, NBD_OPT_SET_META_CONTEXT, buf, p - buf) ||
+		nbd_option_reply(fd, NBD_OPT_SET_META_CONTEXT, &type, buf, sizeof(buf)) ||
+		type != NBD_REP_META_CONTEXT ||
+		nbd_option_reply(fd, NBD_OPT_SET_META_CONTEXT, &type, buf, sizeof(buf)) || type != NBD_REP_ACK) {
+		fprintf(stderr, "nbd: base:allocation refused\n");
+		return 1;
+	}
+
+	put16(put32(buf, 0), 0);
+	if (nbd_option(fd, NBD_OPT_GO, buf, 6)) {
+		return 1;
+	}
+	uint64_t size = 0;
+	do {
+		if (nbd_option_reply(fd, NBD_OPT_GO, &type, buf, sizeof(buf)) ||
+			(type != NBD_REP_INFO && type != NBD_REP_ACK)) {
+			fprintf(stderr, "nbd: export refused\n");
+			return 1;
+		}
+		if (type == NBD_REP_INFO && buf[0] == 0 && buf[1] == NBD_INFO_EXPORT) {
+			size = get64(buf + 2);
+		}
+	} while (type != NBD_REP_ACK);
+	if (size != IMAGE_SIZE) {
+		fprintf(stderr, "nbd: export of %llu bytes\n", (unsigned long long)size);
+		return 1;
+	}
+	return 0;
+}
+
+static int nbd_request(int fd, uint16_t type, uint64_t cookie, uint64_t offset, uint32_t length, const void *data)
+{
+	unsigned char header[NBD_REQUEST_SIZE], *p;
+	p = put32(header, NBD_REQUEST_MAGIC);
+	p = put16(p, 0);
+	p = put16(p, type);
+	p = put64(p, cookie);
+	p = put64(p, offset);
+	put32(p, length);
+	return nbd_send(fd, header, sizeof(header)) || (data != NULL && nbd_send(fd, data, length));
+}
+
+/* reads a structured reply chunk that must end the request, its payload goes to buf */
+static int nbd_reply(int fd, uint64_t cookie, uint16_t type, void *buf, uint32_t size, uint32_t *length)
+{
+	unsigned char header[NBD_STRUCTURED_REPLY_SIZE];
+	if (nbd_recv(fd, header, sizeof(header)) || get32(header) != NBD_STRUCTURED_REPLY_MAGIC) {
+		fprintf(stderr, "nbd: no structured reply\n");
+		return 1;
+	}
+	uint16_t flags = header[4] << 8 | header[5];
+	uint16_t reply_type = header[6] << 8 | header[7];
+	*length = get32(header + 16);
+	if (!(flags & NBD_REPLY_FLAG_DONE) || reply_type != type || get64(header + 8) != cookie || *length > size) {
+		fprintf(stderr, "nbd: reply of type %u to %llu, expected %u\n", reply_type,
+			(unsigned long long)get64(header + 8), type);
+		return 1;
+	}
+	return nbd_recv(fd, buf, *length);
+}
+
+static int nbd_read(int fd, uint64_t cookie, char *buf, uint32_t size, uint64_t offset)
+{
+	static char reply[8 + DATA_SIZE];
+	uint32_t length;
+	if (nbd_request(fd, NBD_CMD_READ, cookie, offset, size, NULL) ||
+		nbd_reply(fd, cookie, NBD_REPLY_TYPE_OFFSET_DATA, reply, sizeof(reply), &length) ||
+		length != 8 + size || get64((unsigned char *)reply) != offset) {
+		fprintf(stderr, "nbd: read of %u at %llu failed\n", size, (unsigned long long)offset);
+		return 1;
+	}
+	memcpy(buf, reply + 8, size);
+	return 0;
+}
+
+/* the state of the first extent base:allocation reports for a range */
+static int nbd_block_status(int fd, uint64_t cookie, uint64_t offset, uint32_t size, uint32_t *state)
+{
+	unsigned char reply[4 + 8 * 1024];
+	uint32_t length, total = 0;
+	if (nbd_request(fd, NBD_CMD_BLOCK_STATUS, cookie, offset, size, NULL) ||
+		nbd_reply(fd, cookie, NBD_REPLY_TYPE_BLOCK_STATUS, reply, sizeof(reply), &length) ||
+		length < 12 || (length - 4) % 8 != 0 || get32(reply) != 1) {
+		fprintf(stderr, "nbd: block status of %u at %llu failed\n", size, (unsigned long long)offset);
+		return 1;
+	}
+	for (uint32_t i = 4; i < length; i += 8) {
+		total += get32(reply + i);
+	}
+	if (total == 0 || total > size) {
+		fprintf(stderr, "nbd: block status of %u at %llu covers %u\n", size, (unsigned long long)offset, total);
+		return 1;
+	}
+	*state = get32(reply + 8);
+	return 0;
+}
+
+static int nbd_check(const char *what, int failed)
+{
+	printf("%s: %s\n", what, failed ? "FAIL" : "ok");
+	return failed;
+}
+
+static int nbd_run(const char *socket_path)
+{
+	static char data[DATA_SIZE], buf[DATA_SIZE];
+	uint32_t length, state;
+	int r = 0;
+	int fd = nbd_connect(socket_path);
+	if (fd < 0) {
+		return 1;
+	}
+	if (nbd_check("handshake", nbd_handshake(fd))) {
+		close(fd);
+		return 1;
+	}
+
+	for (size_t i = 0; i < sizeof(data); i++) {
+		data[i] = i * 7 + i / 4096;
+	}
+	int failed = nbd_request(fd, NBD_CMD_WRITE, 1, DATA_OFFSET, DATA_SIZE, data) ||
+		nbd_reply(fd, 1, NBD_REPLY_TYPE_NONE, buf, 0, &length) ||
+		nbd_read(fd, 2, buf, DATA_SIZE, DATA_OFFSET) || memcmp(buf, data, DATA_SIZE) != 0;
+	r |= nbd_check("write and read back", failed);
+
+	/* the band past the data has no file */
+	failed = nbd_block_status(fd, 3, DATA_OFFSET, DATA_SIZE, &state) || state != 0;
+	failed = failed || nbd_block_status(fd, 4, 3 * BAND_SIZE, BAND_SIZE, &state) ||
+		state != (NBD_STATE_HOLE | NBD_STATE_ZERO);
+	r |= nbd_check("block status", failed);
+
+	/* fills the socket with replies it never reads */
+	int slow = nbd_connect(socket_path);
+	failed = slow < 0 || nbd_handshake(slow);
+	for (int i = 0; !failed && i < SLOW_READS; i++) {
+		failed = nbd_request(slow, NBD_CMD_READ, i, 0, SLOW_READ_SIZE, NULL);
+	}
+	/* give the workers time to get stuck on it, if they would */
+	usleep(200000);
+	failed = failed || nbd_read(fd, 5, buf, DATA_SIZE, DATA_OFFSET) || memcmp(buf, data, DATA_SIZE) != 0;
+	r |= nbd_check("a client not reading its replies", failed);
+
+	if (slow >= 0) {
+		close(slow);
+	}
+	nbd_request(fd, NBD_CMD_DISC, 6, 0, 0, NULL);
+	close(fd);
+	return r;
+}
+
+int main(void)
+{
+	char path[] = "nbd.XXXXXX";
+	alarm(60);
+	signal(SIGPIPE, SIG_IGN);
+	if (mkdtemp(path) == NULL) {
+		perror("nbd: mkdtemp");
+		return 1;
+	}
+	char bundle[sizeof(path) + 32], socket_path[sizeof(path) + 32];
+	snprintf(bundle, sizeof(bundle), "%s/image.sparsebundle", path);
+	snprintf(socket_path, sizeof(socket_path), "%s/socket", path);
+	int r = 1;
+	if (bundle_create(bundle, BAND_SIZE, IMAGE_SIZE)) {
+		perror("nbd: creating the bundle");
+		goto out;
+	}
+	pid_t pid = fork();
+	if (pid == 0) {
+		execl(NBD_SERVER, NBD_SERVER, "-s", socket_path, bundle, (char *)NULL);
+		perror("nbd: " NBD_SERVER);
+		_exit(127);
+	}
+	if (pid < 0) {
+		perror("nbd: fork");
+		goto out;
+	}
+	r = nbd_run(socket_path);
+	int status;
+	kill(pid, SIGTERM);
+	if (waitpid(pid, &status, 0) != pid || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+		fprintf(stderr, "nbd: the server did not exit cleanly\n");
+		r = 1;
+	}
+out:
+	unlink(socket_path);
+	bundle_remove(bundle);
+	rmdir(path);
+	return r;
+}
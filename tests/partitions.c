@@ -0,0 +1,204 @@
+/*
+  writes GPT maps with 512 and 4096 byte sectors and an Apple partition
+  map into images, and checks the partitions sparse_read_partitions finds.
+  a map that does not check out must leave the next format to be found.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "sparsebundle.h"
+#include "partition.h"
+#include "bundle.h"
+
+#define BAND_SIZE (256 << 10)
+#define IMAGE_SIZE (4 << 20)
+#define GPT_ENTRIES 128
+#define GPT_ENTRY_SIZE 128
+#define MAX_PARTITIONS 16
+
+struct partitions_entry {
+	/* 0 for a GPT entry not in use */
+	uint64_t first;
+	/* inclusive for GPT, a block count for APM */
+	uint64_t last;
+};
+
+static unsigned char partitions_image[IMAGE_SIZE];
+
+inline static void put_be16(unsigned char *p, uint16_t v)
+{
+	p[0] = v >> 8;
+	p[1] = v;
+}
+
+inline static void put_be32(unsigned char *p, uint32_t v)
+{
+	put_be16(p, v >> 16);
+	put_be16(p + 2, v);
+}
+
+inline static void put_le32(unsigned char *p, uint32_t v)
+{
+	for (int i = 0; i < 4; i++) {
+		p[i] = v >> (8 * i);
+	}
+}
+
+inline static void put_le64(unsigned char *p, uint64_t v)
+{
+	put_le32(p, v);
+	put_le32(p + 4, v >> 32);
+}
+
+static uint32_t partitions_crc32(const unsigned char *p, size_t size)
+{
+	uint32_t crc = 0xffffffff;
+	while (size--) {
+		crc ^= *p++;
+		for (int i = 0; i < 8; i++) {
+			crc = (crc >> 1) ^ (0xedb88320 & -(crc & 1));
+		}
+	}
+	return ~crc;
+}
+
+/* a protective MBR is not looked at, only the header at LBA 1 and its table */
+static void partitions_gpt(uint32_t sector_size, const struct partitions_entry *entries, int count)
+{
+	unsigned char *header = partitions_image + sector_size;
+	unsigned char *table = partitions_image + 2 * sector_size;
+	for (int i = 0; i < count; i++) {
+		unsigned char *entry = table + (size_t)i * GPT_ENTRY_SIZE;
+		if (entries[i].first == 0) {
+			continue;
+		}
+		/* any type that is not all zeros is in use */
+		memset(entry, 0xaf, 16);
+		put_le64(entry + 32, entries[i].first);
+		put_le64(entry + 40, entries[i].last);
+	}
+	memcpy(header, "EFI PART", 8);
+	put_le32(header + 8, 0x00010000);
+	put_le32(header + 12, 92);
+	put_le64(header + 24, 1);
+	put_le64(header + 72, 2);
+	put_le32(header + 80, GPT_ENTRIES);
+	put_le32(header + 84, GPT_ENTRY_SIZE);
+	put_le32(header + 88, partitions_crc32(table, GPT_ENTRIES * GPT_ENTRY_SIZE));
+	put_le32(header + 16, partitions_crc32(header, 92));
+}
+
+static void partitions_apm_entry(int i, uint32_t entries, uint32_t start, uint32_t blocks, const char *type)
+{
+	unsigned char *block = partitions_image + i * 512;
+	put_be16(block, 0x504d);
+	put_be32(block + 4, entries);
+	put_be32(block + 8, start);
+	put_be32(block + 12, blocks);
+	strncpy((char *)block + 48, type, 32);
+}
+
+static void partitions_apm(const struct partitions_entry *entries, int count)
+{
+	/* driver descriptor with 512 byte blocks, then the map describing itself */
+	put_be16(partitions_image, 0x4552);
+	put_be16(partitions_image + 2, 512);
+	partitions_apm_entry(1, count + 2, 1, count + 2, "Apple_partition_map");
+	for (int i = 0; i < count; i++) {
+		partitions_apm_entry(i + 2, count + 2, entries[i].first, entries[i].last, "Apple_HFS");
+	}
+	partitions_apm_entry(count + 2, count + 2, 8, 56, "Apple_Free");
+}
+
+/* writes the image into a fresh bundle and reads its partitions back */
+static int partitions_check(const char *what, const struct sparse_partition *expected, int count)
+{
+	char path[] = "partitions.XXXXXX";
+	struct sparse_partition found[MAX_PARTITIONS];
+	int r = 1, n = -1;
+	if (mkdtemp(path) == NULL) {
+		perror("partitions: mkdtemp");
+		return 1;
+	}
+	char bundle[sizeof(path) + 32];
+	snprintf(bundle, sizeof(bundle), "%s/image.sparsebundle", path);
+	if (bundle_create(bundle, BAND_SIZE, IMAGE_SIZE)) {
+		perror("partitions: creating the bundle");
+		goto out;
+	}
+	sparse_handle_t state;
+	struct sparse_options options = {
+		.path = bundle,
+	};
+	if (sparse_open(&state, &options)) {
+		fprintf(stderr, "partitions: %s\n", sparse_get_error(NULL));
+		goto out;
+	}
+	if (sparse_pwrite(state, partitions_image, IMAGE_SIZE, 0) == IMAGE_SIZE) {
+		n = sparse_read_partitions(state, found, MAX_PARTITIONS);
+	}
+	sparse_close(&state);
+	r = n != count;
+	for (int i = 0; !r && i < n; i++) {
+		r = found[i].number != expected[i].number || found[i].offset != expected[i].offset ||
+			found[i].length != expected[i].length;
+	}
+	if (r) {
+		fprintf(stderr, "partitions: %s: %d found, %d expected\n", what, n, count);
+		for (int i = 0; i < n; i++) {
+			fprintf(stderr, "partitions:   s%d at %lld, %lld bytes\n", found[i].number,
+				(long long)found[i].offset, (long long)found[i].length);
+		}
+	}
+out:
+	bundle_remove(bundle);
+	rmdir(path);
+	memset(partitions_image, 0, IMAGE_SIZE);
+	printf("%s: %s\n", what, r ? "FAIL" : "ok");
+	return r;
+}
+
+int main(void)
+{
+	int r = 0;
+
+	/* the last one runs past the end of the image and is cut there */
+	static const struct partitions_entry gpt512[] = { { 34, 2081 }, { 2082, 4095 }, { 6000, 20000 } };
+	static const struct sparse_partition gpt512_found[] = {
+		{ 1, 34 * 512, 2048 * 512 },
+		{ 2, 2082 * 512, 2014 * 512 },
+		{ 3, 6000 * 512, IMAGE_SIZE - 6000 * 512 },
+	};
+	partitions_gpt(512, gpt512, 3);
+	r |= partitions_check("gpt 512", gpt512_found, 3);
+
+	/* an entry not in use sits between the partitions, they keep their numbers */
+	static const struct partitions_entry gpt4096[] = { { 6, 261 }, { 0, 0 }, { 262, 1023 } };
+	static const struct sparse_partition gpt4096_found[] = {
+		{ 1, 6 * 4096, 256 * 4096 },
+		{ 3, 262 * 4096, 762 * 4096 },
+	};
+	partitions_gpt(4096, gpt4096, 3);
+	r |= partitions_check("gpt 4096", gpt4096_found, 2);
+
+	static const struct partitions_entry apm[] = { { 64, 1024 }, { 1088, 100000 } };
+	/* the map is a partition of its own */
+	static const struct sparse_partition apm_found[] = {
+		{ 1, 512, 4 * 512 },
+		{ 2, 64 * 512, 1024 * 512 },
+		{ 3, 1088 * 512, IMAGE_SIZE - 1088 * 512 },
+	};
+	partitions_apm(apm, 2);
+	r |= partitions_check("apm", apm_found, 3);
+
+	/* a GPT header failing its checksum is no map, the APM next to it is */
+	partitions_apm(apm, 2);
+	partitions_gpt(4096, gpt512, 1);
+	partitions_image[4096 + 16] ^= 1;
+	r |= partitions_check("apm behind a broken gpt", apm_found, 3);
+
+	r |= partitions_check("no map", NULL, 0);
+	return r;
+}
@@ -0,0 +1,136 @@
+/*
+  maps ranges onto band files with a single band cache slot, so every
+  request spanning two bands holds more bands than the cache keeps.
+  held bands must never be evicted, a hang here fails through alarm.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "sparsebundle.h"
+#include "bundle.h"
+
+#define BAND_SIZE (64 << 10)
+#define IMAGE_SIZE (4 * BAND_SIZE)
+#define BLOCK_SIZE 4096
+#define SEGMENTS 8
+
+static sparse_handle_t segments_state;
+
+/* reads what the segments of a range map to, zeros where there is no file */
+static int segments_read(char *buf, size_t size, off_t offset)
+{
+	struct sparse_segment segments[SEGMENTS];
+	int n = sparse_get_segments(segments_state, size, offset, 0, segments, SEGMENTS);
+	if (n < 0) {
+		fprintf(stderr, "segments: mapping %zu at %lld: %s\n", size, (long long)offset, strerror(-n));
+		return 1;
+	}
+	int r = 0;
+	for (int i = 0; i < n; i++) {
+		if (segments[i].fd < 0) {
+			memset(buf, 0, segments[i].size);
+		} else if (pread(segments[i].fd, buf, segments[i].size, segments[i].offset) != (ssize_t)segments[i].size) {
+			r = 1;
+		}
+		buf += segments[i].size;
+	}
+	sparse_put_segments(segments_state, segments, n);
+	return r;
+}
+
+/* writes a range through its segments */
+static int segments_write(const char *buf, size_t size, off_t offset)
+{
+	struct sparse_segment segments[SEGMENTS];
+	int n = sparse_get_segments(segments_state, size, offset, 1, segments, SEGMENTS);
+	if (n < 0) {
+		fprintf(stderr, "segments: mapping %zu at %lld: %s\n", size, (long long)offset, strerror(-n));
+		return 1;
+	}
+	int r = 0;
+	for (int i = 0; i < n; i++) {
+		if (pwrite(segments[i].fd, buf, segments[i].size, segments[i].offset) != (ssize_t)segments[i].size) {
+			r = 1;
+		}
+		buf += segments[i].size;
+	}
+	sparse_put_segments(segments_state, segments, n);
+	return r;
+}
+
+static int segments_check(const char *what, const char *expected, size_t size, off_t offset)
+{
+	char *buf = malloc(size);
+	int r = segments_read(buf, size, offset);
+	if (r == 0 && memcmp(buf, expected, size) != 0) {
+		r = 1;
+	}
+	if (r == 0) {
+		/* the band cache must still work once the segments are put back */
+		r = sparse_pread(segments_state, buf, size, offset) != (int)size || memcmp(buf, expected, size) != 0;
+	}
+	if (r) {
+		fprintf(stderr, "segments: %s differs\n", what);
+	}
+	free(buf);
+	return r;
+}
+
+static int segments_run(void)
+{
+	static char expected[2 * BLOCK_SIZE];
+	/* the last block of band 0 and the first of band 1 */
+	off_t offset = BAND_SIZE - BLOCK_SIZE;
+	memset(expected, 'a', BLOCK_SIZE);
+	memset(expected + BLOCK_SIZE, 'b', BLOCK_SIZE);
+	if (sparse_pwrite(segments_state, expected, BLOCK_SIZE, offset) != BLOCK_SIZE ||
+		sparse_pwrite(segments_state, expected + BLOCK_SIZE, BLOCK_SIZE, BAND_SIZE) != BLOCK_SIZE) {
+		fprintf(stderr, "segments: cannot write the bands\n");
+		return 1;
+	}
+	if (segments_check("a read across bands", expected, sizeof(expected), offset)) {
+		return 1;
+	}
+	/* bands 2 and 3 have no files yet, mapping them for writing creates them */
+	memset(expected, 'c', sizeof(expected));
+	offset = 3 * BAND_SIZE - BLOCK_SIZE;
+	if (segments_write(expected, sizeof(expected), offset)) {
+		fprintf(stderr, "segments: cannot write across bands\n");
+		return 1;
+	}
+	return segments_check("a write across bands", expected, sizeof(expected), offset);
+}
+
+int main(void)
+{
+	char path[] = "segments.XXXXXX";
+	alarm(60);
+	if (mkdtemp(path) == NULL) {
+		perror("segments: mkdtemp");
+		return 1;
+	}
+	char bundle[sizeof(path) + 32];
+	snprintf(bundle, sizeof(bundle), "%s/image.sparsebundle", path);
+	int r = 1;
+	if (bundle_create(bundle, BAND_SIZE, IMAGE_SIZE)) {
+		perror("segments: creating the bundle");
+		goto out;
+	}
+	struct sparse_options options = {
+		.path = bundle,
+		.max_open_bands = 1,
+	};
+	if (sparse_open(&segments_state, &options)) {
+		fprintf(stderr, "segments: %s\n", sparse_get_error(NULL));
+		goto out;
+	}
+	r = segments_run();
+	sparse_close(&segments_state);
+out:
+	bundle_remove(bundle);
+	rmdir(path);
+	printf("segments: %s\n", r ? "FAIL" : "ok");
+	return r;
+}
@@ -0,0 +1,248 @@
+/*
+  hammers one bundle from several threads with reads, writes, zeros, trims
+  and flushes, checking every read against a shadow copy of the image.
+  requests may share bands but not bytes: each takes the locks of the
+  chunks it covers, so the shadow always says what a read must return.
+  the space the library counts must match the band files in the end.
+*/
+#include <dirent.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/param.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "sparsebundle.h"
+#include "bundle.h"
+
+#define BAND_SIZE (256 << 10)
+/* not a multiple of the band size, so the last band is short */
+#define IMAGE_SIZE ((4 << 20) + (96 << 10))
+#define CHUNK_SIZE (16 << 10)
+#define CHUNKS ((IMAGE_SIZE + CHUNK_SIZE - 1) / CHUNK_SIZE)
+#define MAX_REQUEST (3 * BAND_SIZE / 2)
+#define THREADS 8
+#define OPS 4000
+
+struct stress_mode {
+	const char *name;
+	int mmap_bands;
+	int direct_io;
+};
+
+static const struct stress_mode stress_modes[] = {
+	{ "default", 0, 0 },
+	{ "mmap", 1, 0 },
+	{ "direct", 0, 1 },
+};
+
+static sparse_handle_t stress_state;
+static char *stress_shadow;
+static pthread_mutex_t stress_chunks[CHUNKS];
+static volatile int stress_failed;
+
+static void stress_fail(const char *what, int r, size_t size, off_t offset)
+{
+	fprintf(stderr, "stress: %s of %zu at %lld: %s\n", what, size, (long long)offset, r < 0 ? strerror(-r) : "mismatch");
+	stress_failed = 1;
+}
+
+inline static uint64_t stress_random(uint64_t *seed)
+{
+	*seed ^= *seed << 13;
+	*seed ^= *seed >> 7;
+	*seed ^= *seed << 17;
+	return *seed;
+}
+
+/* locks the chunks under a request, always in ascending order */
+static void stress_lock(size_t size, off_t offset)
+{
+	for (off_t i = offset / CHUNK_SIZE; i <= (offset + (off_t)size - 1) / CHUNK_SIZE; i++) {
+		pthread_mutex_lock(&stress_chunks[i]);
+	}
+}
+
+static void stress_unlock(size_t size, off_t offset)
+{
+	for (off_t i = offset / CHUNK_SIZE; i <= (offset + (off_t)size - 1) / CHUNK_SIZE; i++) {
+		pthread_mutex_unlock(&stress_chunks[i]);
+	}
+}
+
+static void *stress_thread(void *opaque)
+{
+	uint64_t seed = (uintptr_t)opaque * 0x9e3779b97f4a7c15ull + 1;
+	char *buf = malloc(MAX_REQUEST);
+	for (int n = 0; n < OPS && !stress_failed; n++) {
+		int op = stress_random(&seed) % 100;
+		size_t size = stress_random(&seed) % MAX_REQUEST + 1;
+		off_t offset = stress_random(&seed) % IMAGE_SIZE;
+		size = MIN(size, IMAGE_SIZE - (size_t)offset);
+		if (op < 5) {
+			int r = op < 3 ? sparse_flush(stress_state) : sparse_sync(stress_state, op == 4);
+			if (r < 0) {
+				stress_fail("flush", r, 0, 0);
+			}
+			continue;
+		}
+		stress_lock(size, offset);
+		int r;
+		if (op < 45) {
+			r = sparse_pread(stress_state, buf, size, offset);
+			if (r < 0 || memcmp(buf, stress_shadow + offset, size) != 0) {
+				stress_fail("read", r, size, offset);
+			}
+		} else if (op < 85) {
+			for (size_t i = 0; i < size; i += sizeof(uint64_t)) {
+				uint64_t word = stress_random(&seed);
+				memcpy(buf + i, &word, MIN(sizeof(word), size - i));
+			}
+			r = sparse_pwrite(stress_state, buf, size, offset);
+			if (r < 0) {
+				stress_fail("write", r, size, offset);
+			}
+			memcpy(stress_shadow + offset, buf, size);
+		} else if (op < 93) {
+			int flags = op < 89 ? SPARSE_ZERO_MAY_TRIM : op < 91 ? SPARSE_ZERO_MAY_TRIM | SPARSE_ZERO_KEEP_BANDS : 0;
+			r = sparse_zero(stress_state, size, offset, flags);
+			if (r < 0) {
+				stress_fail("zero", r, size, offset);
+			}
+			memset(stress_shadow + offset, 0, size);
+		} else {
+			r = sparse_trim(stress_state, size, offset);
+			if (r < 0) {
+				stress_fail("trim", r, size, offset);
+			}
+			/* only whole bands are trimmed, the image keeps the rest */
+			off_t start = (offset + BAND_SIZE - 1) / BAND_SIZE * BAND_SIZE;
+			off_t end = (offset + size) / BAND_SIZE * BAND_SIZE;
+			if (end > start) {
+				memset(stress_shadow + start, 0, end - start);
+			}
+		}
+		stress_unlock(size, offset);
+	}
+	free(buf);
+	return NULL;
+}
+
+/* reads the whole image back against the shadow */
+static int stress_verify(const char *when)
+{
+	char *buf = malloc(IMAGE_SIZE);
+	int r = sparse_pread(stress_state, buf, IMAGE_SIZE, 0);
+	if (r < 0 || memcmp(buf, stress_shadow, IMAGE_SIZE) != 0) {
+		fprintf(stderr, "stress: image differs %s\n", when);
+		r = 1;
+	} else {
+		r = 0;
+	}
+	free(buf);
+	return r;
+}
+
+/* compares sparse_get_usage with the band files on disk */
+static int stress_usage(const char *path)
+{
+	struct sparse_usage usage;
+	uint64_t allocated = 0, bands = 0;
+	char name[PATH_MAX];
+	if (sparse_flush(stress_state) < 0 || sparse_get_usage(stress_state, &usage)) {
+		fprintf(stderr, "stress: cannot get the usage\n");
+		return 1;
+	}
+	snprintf(name, sizeof(name), "%s/bands", path);
+	DIR *dir = opendir(name);
+	struct dirent *entry;
+	struct stat st;
+	while (dir != NULL && (entry = readdir(dir)) != NULL) {
+		snprintf(name, sizeof(name), "%s/bands/%s", path, entry->d_name);
+		if (entry->d_name[0] != '.' && stat(name, &st) == 0) {
+			allocated += (uint64_t)st.st_blocks * 512;
+			bands++;
+		}
+	}
+	if (dir != NULL) {
+		closedir(dir);
+	}
+	if (usage.allocated != allocated || usage.bands != bands) {
+		fprintf(stderr, "stress: usage of %llu bytes in %llu bands, the band files take %llu in %llu\n",
+			(unsigned long long)usage.allocated, (unsigned long long)usage.bands,
+			(unsigned long long)allocated, (unsigned long long)bands);
+		return 1;
+	}
+	return 0;
+}
+
+static int stress_run(const struct stress_mode *mode)
+{
+	char path[] = "stress.XXXXXX";
+	if (mkdtemp(path) == NULL) {
+		perror("stress: mkdtemp");
+		return 1;
+	}
+	char bundle[sizeof(path) + 32];
+	snprintf(bundle, sizeof(bundle), "%s/image.sparsebundle", path);
+	int r = 1;
+	if (bundle_create(bundle, BAND_SIZE, IMAGE_SIZE)) {
+		perror("stress: creating the bundle");
+		goto out;
+	}
+	struct sparse_options options = {
+		.path = bundle,
+		/* far fewer than the bands in the image, so they are evicted all the time */
+		.max_open_bands = 4,
+		.mmap_bands = mode->mmap_bands,
+		.direct_io = mode->direct_io,
+	};
+	if (sparse_open(&stress_state, &options)) {
+		fprintf(stderr, "stress: %s\n", sparse_get_error(NULL));
+		goto out;
+	}
+	memset(stress_shadow, 0, IMAGE_SIZE);
+	stress_failed = 0;
+	pthread_t threads[THREADS];
+	for (uintptr_t i = 0; i < THREADS; i++) {
+		pthread_create(&threads[i], NULL, stress_thread, (void *)(i + 1));
+	}
+	for (int i = 0; i < THREADS; i++) {
+		pthread_join(threads[i], NULL);
+	}
+	if (stress_failed || stress_verify("after the threads") || stress_usage(bundle)) {
+		sparse_close(&stress_state);
+		goto out;
+	}
+	sparse_close(&stress_state);
+	if (sparse_open(&stress_state, &options)) {
+		fprintf(stderr, "stress: %s\n", sparse_get_error(NULL));
+		goto out;
+	}
+	r = stress_verify("after reopening") || stress_usage(bundle);
+	sparse_close(&stress_state);
+out:
+	bundle_remove(bundle);
+	rmdir(path);
+	printf("%s: %s\n", mode->name, r ? "FAIL" : "ok");
+	return r;
+}
+
+int main(void)
+{
+	int r = 0;
+	stress_shadow = malloc(IMAGE_SIZE);
+	for (int i = 0; i < CHUNKS; i++) {
+		pthread_mutex_init(&stress_chunks[i], NULL);
+	}
+	for (size_t i = 0; i < sizeof(stress_modes) / sizeof(stress_modes[0]); i++) {
+		r |= stress_run(&stress_modes[i]);
+	}
+	free(stress_shadow);
+	return r;
+}